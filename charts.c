@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#include "charts.h"
+#include "clock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <glib.h>
+
+/*
+ * Each window keeps a space-saving summary per kind: at most 'capacity'
+ * counters, sorted by count. A key that isn't there replaces the last one
+ * and inherits its count, which is then its possible error. Whatever is
+ * played more than plays / capacity times is guaranteed to be there.
+ *
+ * Windows are calendar weeks and months in local time, and they start
+ * over when a play from a newer one arrives.
+ */
+
+#define CHARTS_MAGIC 0x48435253 /* "SRCH" */
+#define CHARTS_VERSION 1
+
+struct counter {
+	char *key; /* "artist\ttitle" for tracks */
+	char *artist;
+	const char *title;
+	unsigned count;
+	unsigned error;
+};
+
+struct summary {
+	struct counter *counters;
+	unsigned len;
+	GHashTable *index; /* key to position + 1 */
+};
+
+struct window {
+	unsigned start;
+	struct summary kinds[2];
+};
+
+struct sr_charts {
+	unsigned capacity;
+	struct window windows[SR_CHARTS_LAST];
+	GMutex *mutex;
+};
+
+static void
+summary_init(struct summary *s,
+		unsigned capacity)
+{
+	s->counters = calloc(capacity, sizeof(*s->counters));
+	s->len = 0;
+	s->index = g_hash_table_new(g_str_hash, g_str_equal);
+}
+
+static void
+summary_clear(struct summary *s)
+{
+	for (unsigned i = 0; i < s->len; i++) {
+		g_free(s->counters[i].key);
+		g_free(s->counters[i].artist);
+	}
+	s->len = 0;
+	g_hash_table_remove_all(s->index);
+}
+
+static void
+set_key(struct counter *c,
+		char *key)
+{
+	char *tab;
+
+	c->key = key;
+	tab = strchr(key, '\t');
+	if (tab) {
+		c->artist = g_strndup(key, tab - key);
+		c->title = tab + 1;
+	}
+	else {
+		c->artist = g_strdup(key);
+		c->title = NULL;
+	}
+}
+
+static inline void
+set_position(struct summary *s,
+		unsigned i)
+{
+	g_hash_table_insert(s->index, s->counters[i].key, GUINT_TO_POINTER(i + 1));
+}
+
+/* keeps them sorted; ties stay in place */
+static void
+bubble_up(struct summary *s,
+		unsigned i)
+{
+	while (i > 0 && s->counters[i - 1].count < s->counters[i].count) {
+		struct counter tmp = s->counters[i - 1];
+		s->counters[i - 1] = s->counters[i];
+		s->counters[i] = tmp;
+		set_position(s, i);
+		set_position(s, i - 1);
+		i--;
+	}
+}
+
+/* takes ownership of 'key' */
+static void
+summary_add(struct summary *s,
+		unsigned capacity,
+		char *key,
+		unsigned count,
+		unsigned error)
+{
+	struct counter *c;
+	unsigned i;
+
+	i = GPOINTER_TO_UINT(g_hash_table_lookup(s->index, key));
+	if (i) {
+		g_free(key);
+		s->counters[--i].count += count;
+		bubble_up(s, i);
+		return;
+	}
+
+	if (s->len < capacity)
+		i = s->len++;
+	else {
+		/* replace the least played */
+		i = s->len - 1;
+		c = &s->counters[i];
+		g_hash_table_remove(s->index, c->key);
+		error += c->count;
+		count += c->count;
+		g_free(c->key);
+		g_free(c->artist);
+	}
+
+	c = &s->counters[i];
+	set_key(c, key);
+	c->count = count;
+	c->error = error;
+	set_position(s, i);
+	bubble_up(s, i);
+}
+
+sr_charts_t *
+sr_charts_new(unsigned capacity)
+{
+	sr_charts_t *c;
+
+	c = calloc(1, sizeof(*c));
+	c->capacity = MAX(capacity, 1);
+	for (unsigned w = 0; w < SR_CHARTS_LAST; w++)
+		for (unsigned k = 0; k < 2; k++)
+			summary_init(&c->windows[w].kinds[k], c->capacity);
+	c->mutex = g_mutex_new();
+	return c;
+}
+
+void
+sr_charts_free(sr_charts_t *c)
+{
+	if (!c)
+		return;
+	for (unsigned w = 0; w < SR_CHARTS_LAST; w++) {
+		for (unsigned k = 0; k < 2; k++) {
+			struct summary *s = &c->windows[w].kinds[k];
+			summary_clear(s);
+			g_hash_table_destroy(s->index);
+			free(s->counters);
+		}
+	}
+	g_mutex_free(c->mutex);
+	free(c);
+}
+
+static unsigned
+window_start(int window,
+		unsigned timestamp)
+{
+	struct tm tm;
+	time_t t = timestamp;
+	unsigned days;
+
+	localtime_r(&t, &tm);
+	if (window == SR_CHARTS_WEEK)
+		days = (tm.tm_wday + 6) % 7; /* since monday */
+	else
+		days = tm.tm_mday - 1;
+	/* not all days are 86400 seconds long */
+	tm.tm_mday -= days;
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+void
+sr_charts_add(sr_charts_t *c,
+		sr_track_t *t)
+{
+	if (!t->artist || !t->title)
+		return;
+
+	g_mutex_lock(c->mutex);
+	for (unsigned w = 0; w < SR_CHARTS_LAST; w++) {
+		struct window *win = &c->windows[w];
+		unsigned start = window_start(w, t->timestamp);
+
+		/* too old for this one */
+		if (start < win->start)
+			continue;
+
+		if (start > win->start) {
+			summary_clear(&win->kinds[SR_CHARTS_ARTISTS]);
+			summary_clear(&win->kinds[SR_CHARTS_TRACKS]);
+			win->start = start;
+		}
+
+		summary_add(&win->kinds[SR_CHARTS_ARTISTS], c->capacity,
+				g_strdup(t->artist), 1, 0);
+		summary_add(&win->kinds[SR_CHARTS_TRACKS], c->capacity,
+				g_strconcat(t->artist, "\t", t->title, NULL), 1, 0);
+	}
+	g_mutex_unlock(c->mutex);
+}
+
+unsigned
+sr_charts_top(sr_charts_t *c,
+		int window,
+		int kind,
+		struct sr_charts_entry *result,
+		unsigned n,
+		unsigned *start)
+{
+	struct window *win = &c->windows[window];
+	struct summary *s = &win->kinds[kind];
+	unsigned i;
+
+	g_mutex_lock(c->mutex);
+	/* a window that is over doesn't count as the current one */
+	if (window_start(window, sr_clock_now()) > win->start)
+		n = 0;
+	for (i = 0; i < n && i < s->len; i++) {
+		struct counter *e = &s->counters[i];
+		result[i].artist = e->artist;
+		result[i].title = e->title;
+		result[i].count = e->count;
+		result[i].error = e->error;
+	}
+	if (start)
+		*start = win->start;
+	g_mutex_unlock(c->mutex);
+
+	return i;
+}
+
+/*
+ * The file has a header, and then for each window its start, and for each
+ * kind the number of counters followed by them: count, error, key length
+ * and key.
+ */
+
+struct charts_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+};
+
+static inline bool
+write_u32(FILE *f,
+		uint32_t v)
+{
+	return fwrite(&v, sizeof(v), 1, f) == 1;
+}
+
+static inline bool
+read_u32(FILE *f,
+		uint32_t *v)
+{
+	return fread(v, sizeof(*v), 1, f) == 1;
+}
+
+int
+sr_charts_store(sr_charts_t *c,
+		const char *file)
+{
+	struct charts_header header = { CHARTS_MAGIC, CHARTS_VERSION, c->capacity };
+	char *tmp;
+	FILE *f;
+	bool ok;
+
+	tmp = g_strconcat(file, ".tmp", NULL);
+	f = fopen(tmp, "wb");
+	if (!f) {
+		g_free(tmp);
+		return 1;
+	}
+
+	g_mutex_lock(c->mutex);
+	ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	for (unsigned w = 0; ok && w < SR_CHARTS_LAST; w++) {
+		struct window *win = &c->windows[w];
+		ok = write_u32(f, win->start);
+		for (unsigned k = 0; ok && k < 2; k++) {
+			struct summary *s = &win->kinds[k];
+			ok = write_u32(f, s->len);
+			for (unsigned i = 0; ok && i < s->len; i++) {
+				struct counter *e = &s->counters[i];
+				uint32_t len = strlen(e->key);
+				ok = write_u32(f, e->count) && write_u32(f, e->error) &&
+					write_u32(f, len) &&
+					fwrite(e->key, 1, len, f) == len;
+			}
+		}
+	}
+	g_mutex_unlock(c->mutex);
+
+	ok = fclose(f) == 0 && ok;
+	/* never leave a half-written one */
+	if (ok)
+		ok = rename(tmp, file) == 0;
+	else
+		remove(tmp);
+	g_free(tmp);
+
+	return !ok;
+}
+
+int
+sr_charts_load(sr_charts_t *c,
+		const char *file)
+{
+	struct charts_header header;
+	FILE *f;
+	bool ok;
+
+	f = fopen(file, "rb");
+	if (!f)
+		return 1;
+
+	ok = fread(&header, sizeof(header), 1, f) == 1 &&
+		header.magic == CHARTS_MAGIC &&
+		header.version == CHARTS_VERSION;
+
+	g_mutex_lock(c->mutex);
+	for (unsigned w = 0; ok && w < SR_CHARTS_LAST; w++) {
+		struct window *win = &c->windows[w];
+		uint32_t start;
+
+		ok = read_u32(f, &start);
+		win->start = start;
+		for (unsigned k = 0; ok && k < 2; k++) {
+			struct summary *s = &win->kinds[k];
+			uint32_t len;
+
+			summary_clear(s);
+			ok = read_u32(f, &len);
+			for (unsigned i = 0; ok && i < len; i++) {
+				uint32_t count, error, key_len;
+				char *key;
+
+				ok = read_u32(f, &count) && read_u32(f, &error) &&
+					read_u32(f, &key_len) && key_len < 0x1000;
+				if (!ok)
+					break;
+				key = g_malloc(key_len + 1);
+				ok = fread(key, 1, key_len, f) == key_len;
+				key[key_len] = '\0';
+				if (!ok) {
+					g_free(key);
+					break;
+				}
+				/* a smaller capacity keeps the top ones */
+				if (s->len < c->capacity)
+					summary_add(s, c->capacity, key, count, error);
+				else
+					g_free(key);
+			}
+		}
+	}
+	if (!ok) {
+		for (unsigned w = 0; w < SR_CHARTS_LAST; w++) {
+			c->windows[w].start = 0;
+			summary_clear(&c->windows[w].kinds[0]);
+			summary_clear(&c->windows[w].kinds[1]);
+		}
+	}
+	g_mutex_unlock(c->mutex);
+
+	fclose(f);
+	return !ok;
+}
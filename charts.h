@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#ifndef CHARTS_H
+#define CHARTS_H
+
+#include "scrobble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum sr_charts_window {
+	SR_CHARTS_WEEK,
+	SR_CHARTS_MONTH,
+	SR_CHARTS_LAST,
+};
+
+enum sr_charts_kind {
+	SR_CHARTS_ARTISTS,
+	SR_CHARTS_TRACKS,
+};
+
+struct sr_charts_entry {
+	const char *artist;
+	const char *title; /* NULL for artists */
+	unsigned count;
+	unsigned error; /* the count might be this much too high */
+};
+
+/* 'capacity' bounds the entries kept per window and kind */
+sr_charts_t *sr_charts_new(unsigned capacity);
+void sr_charts_free(sr_charts_t *c);
+int sr_charts_load(sr_charts_t *c, const char *file);
+int sr_charts_store(sr_charts_t *c, const char *file);
+void sr_charts_add(sr_charts_t *c, sr_track_t *t);
+
+/*
+ * The current week or month, most played first. The strings belong to the
+ * charts and are valid until the next add.
+ */
+unsigned sr_charts_top(sr_charts_t *c, int window, int kind,
+		struct sr_charts_entry *result, unsigned n, unsigned *start);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHARTS_H */
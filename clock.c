@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#include "clock.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <glib.h>
+
+struct vtimer {
+	unsigned id;
+	uint64_t due; /* msec */
+	unsigned interval;
+	sr_timeout_func func;
+	void *data;
+	bool removed;
+};
+
+static bool virtual;
+static uint64_t virtual_now; /* msec */
+static GQueue vtimers = G_QUEUE_INIT;
+static unsigned last_id;
+static struct vtimer *running;
+
+unsigned
+sr_clock_now(void)
+{
+	if (virtual)
+		return virtual_now / 1000;
+	return time(NULL);
+}
+
+uint64_t
+sr_clock_monotonic(void)
+{
+	struct timespec ts;
+
+	if (virtual)
+		return virtual_now;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+vtimer_compare(const void *a,
+		const void *b,
+		void *user_data)
+{
+	const struct vtimer *ta = a, *tb = b;
+
+	if (ta->due != tb->due)
+		return ta->due < tb->due ? -1 : 1;
+	/* same order as they were added */
+	return ta->id < tb->id ? -1 : 1;
+}
+
+static unsigned
+vtimer_add(unsigned msec,
+		sr_timeout_func func,
+		void *data)
+{
+	struct vtimer *t;
+
+	t = calloc(1, sizeof(*t));
+	t->id = ++last_id;
+	t->due = virtual_now + msec;
+	t->interval = msec;
+	t->func = func;
+	t->data = data;
+	g_queue_insert_sorted(&vtimers, t, vtimer_compare, NULL);
+	return t->id;
+}
+
+unsigned
+sr_timeout_add(unsigned msec,
+		sr_timeout_func func,
+		void *data)
+{
+	if (virtual)
+		return vtimer_add(msec, func, data);
+	return g_timeout_add(msec, func, data);
+}
+
+unsigned
+sr_timeout_add_seconds(unsigned sec,
+		sr_timeout_func func,
+		void *data)
+{
+	if (virtual)
+		return vtimer_add(sec * 1000, func, data);
+	return g_timeout_add_seconds(sec, func, data);
+}
+
+void
+sr_timeout_remove(unsigned id)
+{
+	GList *c;
+
+	if (!virtual) {
+		g_source_remove(id);
+		return;
+	}
+
+	if (running && running->id == id) {
+		running->removed = true;
+		return;
+	}
+
+	for (c = vtimers.head; c; c = c->next) {
+		struct vtimer *t = c->data;
+		if (t->id != id)
+			continue;
+		g_queue_delete_link(&vtimers, c);
+		free(t);
+		return;
+	}
+}
+
+void
+sr_clock_set_virtual(unsigned start)
+{
+	virtual = true;
+	virtual_now = (uint64_t) start * 1000;
+}
+
+void
+sr_clock_advance(unsigned msec)
+{
+	uint64_t target = virtual_now + msec;
+	struct vtimer *t;
+
+	while ((t = g_queue_peek_head(&vtimers)) && t->due <= target) {
+		g_queue_pop_head(&vtimers);
+		virtual_now = t->due;
+
+		running = t;
+		if (t->func(t->data) && !t->removed) {
+			t->due += t->interval ? t->interval : 1;
+			g_queue_insert_sorted(&vtimers, t, vtimer_compare, NULL);
+		}
+		else
+			free(t);
+		running = NULL;
+	}
+
+	virtual_now = target;
+}
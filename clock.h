@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int (*sr_timeout_func) (void *data);
+
+/* unix time, real or virtual */
+unsigned sr_clock_now(void);
+/* msec from an arbitrary point, for measuring intervals */
+uint64_t sr_clock_monotonic(void);
+
+unsigned sr_timeout_add(unsigned msec, sr_timeout_func func, void *data);
+unsigned sr_timeout_add_seconds(unsigned sec, sr_timeout_func func, void *data);
+void sr_timeout_remove(unsigned id);
+
+/*
+ * Switch to a virtual clock starting at 'start'. Has to be done before any
+ * timeout is added. Virtual timeouts only fire from sr_clock_advance().
+ */
+void sr_clock_set_virtual(unsigned start);
+void sr_clock_advance(unsigned msec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CLOCK_H */
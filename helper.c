@@ -12,26 +12,78 @@
 #include <dbus/dbus-glib-lowlevel.h>
 
 #include <stdbool.h>
+#include <string.h>
 
 #include "helper.h"
 #include "scrobble.h"
+#include "history.h"
+#include "charts.h"
+#include "ledger.h"
+#include "trace.h"
+#include "clock.h"
 
-static sr_track_t *track;
+struct hp_source {
+	char *name;
+	sr_track_t *track; /* being filled */
+	sr_track_t *playing; /* committed */
+	bool loved;
+	int next_timer;
+};
+
+static GSList *sources;
+/* the one that committed a track last */
+static hp_source_t *current;
+static hp_now_playing_func now_playing_func;
+static void *now_playing_data;
 
 static GKeyFile *keyfile;
 static char *conf_file;
 static char *cache_dir;
+static char *trace_file;
 static int connected;
 
+struct export {
+	sr_session_t *session;
+	FILE *f;
+	int format;
+	int count;
+	hp_export_func func;
+	void *data;
+	GThread *thread;
+	unsigned idle; /* export_done, once the thread is over */
+};
+
+/* still running */
+static GSList *exports;
+
 static DBusConnection *dbus_system;
 static ConIcConnection *connection;
-static int next_timer;
+static int reload_timer;
+
+/* outbound work is sent in bursts, see schedule_flush() */
+static int flush_timer;
+static uint64_t flush_due;
+static unsigned batch_size = 1;
+static unsigned batch_delay = 30 * 60;
+static unsigned batched;
+static unsigned windows;
+
+/* entries kept per window and kind */
+#define CHARTS_SIZE 64
+
+static GTimer *startup_timer;
+static unsigned loading;
 
 struct service {
 	const char *id;
 	const char *url;
 	sr_session_t *session;
 	char *cache;
+	sr_history_t *history;
+	sr_charts_t *charts;
+	sr_ledger_t *ledger;
+	GThread *loader;
+	bool loaded;
 
 	/* web-service */
 	const char *api_url;
@@ -61,62 +113,328 @@ static void error_cb(sr_session_t *s,
 static void scrobble_cb(sr_session_t *s)
 {
 	struct service *service = s->user_data;
+	char *file;
+
 	sr_session_store_list(s, service->cache);
+	file = g_strconcat(service->cache, ".charts", NULL);
+	sr_charts_store(service->charts, file);
+	g_free(file);
 }
 
 static void session_key_cb(sr_session_t *s, const char *session_key)
 {
 	struct service *service = s->user_data;
+	char *data;
+
 	g_key_file_set_string(keyfile, service->id, "session-key", session_key);
-	g_file_set_contents(conf_file,
-			g_key_file_to_data(keyfile, NULL, NULL),
-			-1, NULL);
+	data = g_key_file_to_data(keyfile, NULL, NULL);
+	g_file_set_contents(conf_file, data, -1, NULL);
+	g_free(data);
+}
+
+static void
+flush(struct service *s)
+{
+	if (!connected || !s->on || !s->loaded)
+		return;
+	sr_session_flush(s->session);
+}
+
+/* sessions only send on their own when the radio can be used freely */
+static void
+update_hold(void)
+{
+	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++)
+		sr_session_hold(services[i].session, !connected || batch_size > 1);
+}
+
+static gboolean
+do_flush(void *data)
+{
+	flush_timer = 0;
+	hp_flush();
+	return FALSE;
+}
+
+/*
+ * Everything pending goes out together no later than 'delay' seconds from
+ * now, so the radio wakes up once for all of it. Nothing is scheduled
+ * while disconnected, the connection event does that.
+ */
+static void
+schedule_flush(unsigned delay)
+{
+	uint64_t due;
+
+	if (!connected)
+		return;
+
+	if (!delay) {
+		hp_flush();
+		return;
+	}
+
+	due = sr_clock_monotonic() + delay * 1000;
+	if (flush_timer) {
+		if (flush_due <= due)
+			return;
+		sr_timeout_remove(flush_timer);
+	}
+	flush_due = due;
+	flush_timer = sr_timeout_add_seconds(delay, do_flush, NULL);
+}
+
+static void
+add_batched(unsigned count)
+{
+	batched += count;
+	schedule_flush(batched >= batch_size ? 0 : batch_delay);
+}
+
+static void
+set_batching(void)
+{
+	int size, delay;
+
+	size = g_key_file_get_integer(keyfile, "general", "batch-size", NULL);
+	/* in minutes */
+	delay = g_key_file_get_integer(keyfile, "general", "batch-delay", NULL);
+
+	batch_size = MAX(size, 1);
+	batch_delay = delay > 0 ? delay * 60 : 30 * 60;
+	update_hold();
+}
+
+static void
+set_retention(struct service *s)
+{
+	int max_age, max_count;
+	char *archive = NULL;
+
+	/* max-age is in days */
+	max_age = g_key_file_get_integer(keyfile, s->id, "max-age", NULL);
+	max_count = g_key_file_get_integer(keyfile, s->id, "max-count", NULL);
+	if (g_key_file_get_boolean(keyfile, s->id, "archive", NULL))
+		archive = g_strconcat(s->cache, ".archive", NULL);
+
+	sr_session_set_retention(s->session,
+			MAX(max_age, 0) * 24 * 60 * 60,
+			MAX(max_count, 0),
+			archive);
+	g_free(archive);
+}
+
+static void
+set_budget(struct service *s)
+{
+	int budget;
+	char *policy, *spill = NULL;
+	int mode = SR_BUDGET_EVICT;
+
+	/* memory-budget is in KiB */
+	budget = g_key_file_get_integer(keyfile, s->id, "memory-budget", NULL);
+	policy = g_key_file_get_string(keyfile, s->id, "memory-policy", NULL);
+	if (policy && strcmp(policy, "spill") == 0) {
+		mode = SR_BUDGET_SPILL;
+		spill = g_strconcat(s->cache, ".spill", NULL);
+	}
+
+	sr_session_set_memory_budget(s->session, MAX(budget, 0) * 1024, mode, spill);
+	g_free(policy);
+	g_free(spill);
+}
+
+static void
+set_timeouts(struct service *s)
+{
+	static const char *keys[SR_REQUEST_LAST] = {
+		[SR_REQUEST_HANDSHAKE] = "handshake-timeout",
+		[SR_REQUEST_SUBMIT] = "submit-timeout",
+		[SR_REQUEST_NOW_PLAYING] = "now-playing-timeout",
+		[SR_REQUEST_WS] = "love-timeout",
+	};
+
+	/* in seconds, 0 for none; otherwise the library default */
+	for (unsigned i = 0; i < SR_REQUEST_LAST; i++) {
+		GError *error = NULL;
+		int sec;
+
+		sec = g_key_file_get_integer(keyfile, s->id, keys[i], &error);
+		if (error) {
+			g_error_free(error);
+			sec = -1;
+		}
+		sr_session_set_timeout(s->session, i, sec);
+	}
+}
+
+static bool
+key_changed(GKeyFile *old,
+		const char *group,
+		const char *key)
+{
+	char *a, *b;
+	bool changed;
+
+	a = old ? g_key_file_get_string(old, group, key, NULL) : NULL;
+	b = g_key_file_get_string(keyfile, group, key, NULL);
+	changed = g_strcmp0(a, b) != 0;
+	g_free(a);
+	g_free(b);
+
+	return changed;
 }
 
+/* only touches what changed since 'old' */
 static gboolean
-authenticate_session(struct service *s)
+authenticate_session(struct service *s,
+		GKeyFile *old)
 {
 	gchar *username, *password;
 	gchar *session_key;
+	gchar *url, *api_url;
 	gboolean ok = true;
+	bool changed = !s->on;
 
 	username = g_key_file_get_string(keyfile, s->id, "username", NULL);
 	password = g_key_file_get_string(keyfile, s->id, "password", NULL);
 	session_key = g_key_file_get_string(keyfile, s->id, "session-key", NULL);
+	url = g_key_file_get_string(keyfile, s->id, "url", NULL);
+	api_url = g_key_file_get_string(keyfile, s->id, "api-url", NULL);
 
 	if (!username || !username[0])
 		ok = false;
 	if (!password || !password[0])
 		ok = false;
-	if (!ok)
+	if (!ok) {
+		if (s->on) {
+			s->on = false;
+			if (s->loaded)
+				sr_session_store_list(s->session, s->cache);
+		}
 		goto leave;
+	}
 
-	sr_session_set_cred(s->session, username, password);
-	if (session_key)
+	if (changed || key_changed(old, s->id, "username") ||
+			key_changed(old, s->id, "password")) {
+		sr_session_set_cred(s->session, username, password);
+		changed = true;
+	}
+
+	if (changed || key_changed(old, s->id, "url") ||
+			key_changed(old, s->id, "api-url")) {
+		sr_session_set_url(s->session, url ? url : s->url);
+		if (s->api_key)
+			sr_session_set_api(s->session, api_url ? api_url : s->api_url,
+					s->api_key, s->api_secret);
+		changed = true;
+	}
+
+	if (session_key && key_changed(old, s->id, "session-key"))
 		sr_session_set_session_key(s->session, session_key);
-	if (connected)
-		sr_session_handshake(s->session);
+
+	if (changed) {
+		char *file;
+		int validity;
+
+		/* in hours */
+		validity = g_key_file_get_integer(keyfile, s->id, "session-validity", NULL);
+		if (validity <= 0)
+			validity = 24;
+
+		file = g_strconcat(s->cache, ".session", NULL);
+		sr_session_set_handshake_cache(s->session, file, validity * 60 * 60);
+		g_free(file);
+	}
+
+	set_retention(s);
+	set_budget(s);
+	set_timeouts(s);
 
 	s->on = true;
+	if (changed)
+		flush(s);
 
 leave:
 	g_free(username);
 	g_free(password);
+	g_free(session_key);
+	g_free(url);
+	g_free(api_url);
 
 	return ok;
 }
 
+static void
+cache_loaded(struct service *service)
+{
+	service->loaded = true;
+	sr_session_set_history(service->session, service->history);
+	sr_session_set_charts(service->session, service->charts);
+
+	if (startup_timer)
+		g_message("%s: cache loaded at %.3fs", service->id,
+				g_timer_elapsed(startup_timer, NULL));
+
+	if (--loading == 0 && startup_timer) {
+		g_timer_destroy(startup_timer);
+		startup_timer = NULL;
+	}
+
+	flush(service);
+}
+
+static gboolean
+cache_loaded_idle(void *data)
+{
+	struct service *service = data;
+
+	if (service->loader) {
+		g_thread_join(service->loader);
+		service->loader = NULL;
+	}
+	cache_loaded(service);
+	return FALSE;
+}
+
+static void *
+load_cache(void *data)
+{
+	struct service *service = data;
+	char *file;
+
+	/* first, so the queue doesn't bring back what was acknowledged */
+	file = g_strconcat(service->cache, ".ledger", NULL);
+	service->ledger = sr_ledger_open(file, LEDGER_BOUND);
+	g_free(file);
+	sr_session_set_ledger(service->session, service->ledger);
+	sr_session_load_list(service->session, service->cache);
+	file = g_strconcat(service->cache, ".history", NULL);
+	service->history = sr_history_open(file);
+	g_free(file);
+	file = g_strconcat(service->cache, ".charts", NULL);
+	sr_charts_load(service->charts, file);
+	g_free(file);
+
+	g_idle_add(cache_loaded_idle, service);
+	return NULL;
+}
+
 static void
 get_session(struct service *service)
 {
 	sr_session_t *s;
+	char *quarantine;
 	s = sr_session_new(service->url, "mms", "1.0");
 	s->user_data = service;
 	s->error_cb = error_cb;
 	s->scrobble_cb = scrobble_cb;
 	s->session_key_cb = session_key_cb;
 	service->cache = g_build_filename(cache_dir, service->id, NULL);
-	sr_session_load_list(s, service->cache);
+	service->charts = sr_charts_new(CHARTS_SIZE);
+	quarantine = g_strconcat(service->cache, ".quarantine", NULL);
+	sr_session_set_quarantine(s, quarantine);
+	g_free(quarantine);
 	if (service->api_key)
 		sr_session_set_api(s, service->api_url,
 				service->api_key, service->api_secret);
@@ -126,17 +444,33 @@ get_session(struct service *service)
 static void
 authenticate(void)
 {
-	gboolean ok;
+	GKeyFile *old, *new;
 	unsigned i;
 
-	keyfile = g_key_file_new();
-
-	ok = g_key_file_load_from_file(keyfile, conf_file, G_KEY_FILE_NONE, NULL);
-	if (!ok)
+	new = g_key_file_new();
+	if (!g_key_file_load_from_file(new, conf_file, G_KEY_FILE_NONE, NULL)) {
+		g_key_file_free(new);
 		return;
+	}
+
+	old = keyfile;
+	keyfile = new;
+
+	set_batching();
 
 	for (i = 0; i < G_N_ELEMENTS(services); i++)
-		authenticate_session(&services[i]);
+		authenticate_session(&services[i], old);
+
+	if (old)
+		g_key_file_free(old);
+}
+
+static gboolean
+reload_conf(void *data)
+{
+	reload_timer = 0;
+	authenticate();
+	return FALSE;
 }
 
 static void
@@ -146,9 +480,14 @@ conf_changed(GFileMonitor *monitor,
 		GFileMonitorEvent event_type,
 		void *user_data)
 {
-	if (event_type == G_FILE_MONITOR_EVENT_CHANGED ||
-			event_type == G_FILE_MONITOR_EVENT_CREATED)
-		authenticate();
+	if (event_type != G_FILE_MONITOR_EVENT_CHANGED &&
+			event_type != G_FILE_MONITOR_EVENT_CREATED)
+		return;
+
+	/* a single save usually generates several events */
+	if (reload_timer)
+		sr_timeout_remove(reload_timer);
+	reload_timer = sr_timeout_add(500, reload_conf, NULL);
 }
 
 static void
@@ -163,15 +502,35 @@ monitor_conf(void)
 	g_object_unref(file);
 }
 
+static gboolean
+report_windows(void *data)
+{
+	unsigned total = 0;
+
+	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
+		struct sr_session_stats stats;
+		sr_session_get_stats(services[i].session, &stats);
+		total += stats.windows;
+	}
+	sr_trace(SR_TRACE_WINDOWS, 0, total - windows, total);
+	windows = total;
+	return TRUE;
+}
+
 static gboolean
 timeout(void *data)
 {
 	unsigned i;
 	for (i = 0; i < G_N_ELEMENTS(services); i++) {
 		struct service *s = &services[i];
-		if (!s->on)
+		char *file;
+
+		if (!s->on || !s->loaded)
 			continue;
 		sr_session_store_list(s->session, s->cache);
+		file = g_strconcat(s->cache, ".charts", NULL);
+		sr_charts_store(s->charts, file);
+		g_free(file);
 	}
 	return TRUE;
 }
@@ -204,14 +563,43 @@ connection_event(ConIcConnection *connection,
 	ConIcConnectionStatus status;
 	status = con_ic_connection_event_get_status(event);
 	if (status == CON_IC_STATUS_CONNECTED) {
-		unsigned i;
-		connected = 1;
 		check_proxy(connection);
-		for (i = 0; i < G_N_ELEMENTS(services); i++)
-			sr_session_handshake(services[i].session);
+		hp_set_connected(true);
 	}
 	else if (status == CON_IC_STATUS_DISCONNECTING)
-		connected = 0;
+		hp_set_connected(false);
+}
+
+/* everything that can wait until the main loop is running */
+static gboolean
+late_init(void *data)
+{
+	if (startup_timer)
+		g_message("main loop reached at %.3fs",
+				g_timer_elapsed(startup_timer, NULL));
+
+	g_mkdir_with_parents(cache_dir, 0755);
+
+	/* caches are loaded in parallel */
+	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
+		struct service *s = &services[i];
+		loading++;
+		s->loader = g_thread_create(load_cache, s, TRUE, NULL);
+		if (!s->loader)
+			load_cache(s);
+	}
+
+	authenticate();
+	monitor_conf();
+
+	dbus_system = dbus_bus_get(DBUS_BUS_SYSTEM, NULL);
+	if (dbus_system)
+		dbus_connection_setup_with_g_main(dbus_system, NULL);
+	connection = con_ic_connection_new();
+	g_signal_connect(connection, "connection-event", G_CALLBACK(connection_event), NULL);
+	g_object_set(connection, "automatic-connection-events", TRUE, NULL);
+
+	return FALSE;
 }
 
 void hp_init(void)
@@ -220,95 +608,292 @@ void hp_init(void)
 	if (!g_thread_supported())
 		g_thread_init(NULL);
 
+	if (g_getenv("SCROBBLER_STARTUP_TIME"))
+		startup_timer = g_timer_new();
+
 #ifdef MAEMO5
 	conf_file = g_build_filename(g_get_home_dir(), ".osso", "scrobbler", NULL);
 #else
 	conf_file = g_build_filename(g_get_user_config_dir(), "scrobbler", NULL);
 #endif
 	cache_dir = g_build_filename(g_get_user_cache_dir(), "scrobbler", NULL);
-
-	g_mkdir_with_parents(cache_dir, 0755);
+	trace_file = g_build_filename(cache_dir, "trace", NULL);
 
 	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++)
 		get_session(&services[i]);
+	update_hold();
 
-	authenticate();
-	monitor_conf();
-
-	dbus_system = dbus_bus_get(DBUS_BUS_SYSTEM, NULL);
-	dbus_connection_setup_with_g_main(dbus_system, NULL);
-	connection = con_ic_connection_new();
-	g_signal_connect(connection, "connection-event", G_CALLBACK(connection_event), NULL);
-	g_object_set(connection, "automatic-connection-events", TRUE, NULL);
-
-	track = sr_track_new();
-	track->source = 'P';
-
-	g_timeout_add_seconds(10 * 60, timeout, NULL);
+	g_idle_add(late_init, NULL);
+	sr_timeout_add_seconds(10 * 60, timeout, NULL);
+	sr_timeout_add_seconds(60 * 60, report_windows, NULL);
 }
 
 void hp_deinit(void)
 {
-	g_object_unref(connection);
-	dbus_connection_unref(dbus_system);
+	if (connection)
+		g_object_unref(connection);
+	if (dbus_system)
+		dbus_connection_unref(dbus_system);
 
-	g_key_file_free(keyfile);
+	if (keyfile)
+		g_key_file_free(keyfile);
 
 	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
 		struct service *s = &services[i];
-		if (!s->on)
+		if (s->loader) {
+			g_thread_join(s->loader);
+			s->loader = NULL;
+			s->loaded = true;
+			sr_session_set_history(s->session, s->history);
+			sr_session_set_charts(s->session, s->charts);
+		}
+	}
+
+	/* the main loop is over, export_done won't run */
+	while (exports) {
+		struct export *e = exports->data;
+		g_thread_join(e->thread);
+		g_source_remove(e->idle);
+		exports = g_slist_delete_link(exports, exports);
+		e->func(-1, e->data);
+		g_free(e);
+	}
+
+	/* queues what they were playing */
+	while (sources)
+		hp_source_free(sources->data);
+
+	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
+		struct service *s = &services[i];
+		char *file;
+
+		if (!s->on || !s->loaded)
 			continue;
-		sr_session_pause(s->session);
 		sr_session_store_list(s->session, s->cache);
+		file = g_strconcat(s->cache, ".charts", NULL);
+		sr_charts_store(s->charts, file);
+		g_free(file);
 	}
 
-	sr_track_free(track);
-
 	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
 		struct service *s = &services[i];
 		g_free(s->cache);
 		sr_session_free(s->session);
+		sr_history_close(s->history);
+		sr_charts_free(s->charts);
+		sr_ledger_close(s->ledger);
 	}
 
 	g_free(cache_dir);
 	g_free(conf_file);
+	g_free(trace_file);
+	trace_file = NULL;
+
+	if (reload_timer) {
+		sr_timeout_remove(reload_timer);
+		reload_timer = 0;
+	}
 
-	if (next_timer) {
-		g_source_remove(next_timer);
-		next_timer = 0;
+	if (flush_timer) {
+		sr_timeout_remove(flush_timer);
+		flush_timer = 0;
 	}
 }
 
-void hp_submit(void)
+void hp_set_connected(bool on)
 {
-	unsigned i;
-	if (!track->artist || !track->title)
-		goto clear;
+	connected = on;
+	update_hold();
+	if (!connected) {
+		if (flush_timer) {
+			sr_timeout_remove(flush_timer);
+			flush_timer = 0;
+		}
+		return;
+	}
+
+	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++)
+		sr_session_reconnected(services[i].session);
+	/* let the link settle, then drain everything at once */
+	schedule_flush(2);
+}
+
+void hp_flush(void)
+{
+	if (flush_timer) {
+		sr_timeout_remove(flush_timer);
+		flush_timer = 0;
+	}
+
+	sr_trace(SR_TRACE_FLUSH, 0, batched, 0);
+	batched = 0;
+	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++)
+		flush(&services[i]);
+}
+
+hp_source_t *hp_source_new(const char *name)
+{
+	hp_source_t *src;
+
+	src = g_new0(hp_source_t, 1);
+	src->name = g_strdup(name);
+	src->track = sr_track_new();
+	src->track->source = 'P';
+	sources = g_slist_prepend(sources, src);
+	return src;
+}
+
+/*
+ * The source moved on, queue what it was playing if it counts; returns
+ * how many services took it.
+ */
+static unsigned
+finish(hp_source_t *src,
+		unsigned end)
+{
+	sr_track_t *t = src->playing;
+	struct service *last = NULL;
+	unsigned count = 0, playtime;
+	bool played;
+
+	if (!t)
+		return 0;
+
+	if (src->loved)
+		t->rating = 'L';
+
+	played = sr_track_played(t, end);
+	playtime = end - t->timestamp;
+
+	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
+		struct service *s = &services[i];
+		sr_track_t *copy;
+
+		if (!s->on)
+			continue;
+		if (src->loved)
+			sr_session_love(s->session, t->artist, t->title, true);
+		if (!played)
+			continue;
+		/* only the last one gets the original */
+		if (last) {
+			copy = sr_track_dup(t);
+			count += sr_session_queue_tracks(last->session, &copy, 1);
+		}
+		last = s;
+	}
+
+	if (last)
+		count += sr_session_queue_tracks(last->session, &t, 1);
+	else
+		sr_track_free(t);
+
+	sr_trace(SR_TRACE_CHECK_LAST, 0, playtime, count);
+
+	src->playing = NULL;
+	src->loved = false;
+	return count;
+}
+
+void hp_source_free(hp_source_t *src)
+{
+	if (src->next_timer)
+		sr_timeout_remove(src->next_timer);
+	finish(src, sr_clock_now());
+	if (current == src)
+		current = NULL;
+	sources = g_slist_remove(sources, src);
+	sr_track_free(src->track);
+	g_free(src->name);
+	g_free(src);
+}
+
+void hp_submit(hp_source_t *src)
+{
+	sr_track_t *track = src->track;
+	unsigned i, count = 0, queued;
+
+	if (!track->artist || !track->title) {
+		/* resumed; what was playing still is */
+		g_free(track->artist);
+		track->artist = NULL;
+		g_free(track->title);
+		track->title = NULL;
+		track->length = 0;
+		g_free(track->album);
+		track->album = NULL;
+		sr_trace(SR_TRACE_SUBMIT, 0, 0, 0);
+		return;
+	}
+
+	queued = finish(src, track->timestamp);
+
+	/* the staged track itself becomes the playing one */
+	src->playing = track;
+	src->track = sr_track_new();
+	src->track->source = 'P';
 	for (i = 0; i < G_N_ELEMENTS(services); i++) {
 		struct service *s = &services[i];
 		if (!s->on)
 			continue;
-		sr_session_add_track(s->session, sr_track_dup(track));
-		sr_session_submit(s->session);
+		sr_session_now_playing(s->session, sr_track_dup(track));
+		count++;
 	}
-clear:
-	g_free(track->artist);
-	track->artist = NULL;
-	g_free(track->title);
-	track->title = NULL;
-	track->length = 0;
-	g_free(track->album);
-	track->album = NULL;
+
+	current = src;
+	if (now_playing_func)
+		now_playing_func(src->playing, src->loved, now_playing_data);
+
+	/* now-playings aren't batched, only what was queued */
+	if (queued)
+		add_batched(1);
+
+	sr_trace(SR_TRACE_SUBMIT, 0, count, 0);
 }
 
-void hp_love_current(bool on)
+/* tracks played elsewhere, takes ownership */
+int hp_submit_tracks(sr_track_t **tracks, unsigned count)
 {
-	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
+	sr_track_t **copy;
+	unsigned i, services_count = 0;
+	int queued = 0, most = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!tracks[i]->source)
+			tracks[i]->source = 'P';
+	}
+
+	copy = g_new(sr_track_t *, count);
+	for (i = 0; i < G_N_ELEMENTS(services); i++) {
 		struct service *s = &services[i];
+		int n;
+
 		if (!s->on)
 			continue;
-		sr_session_set_love(s->session, on);
+		for (unsigned j = 0; j < count; j++)
+			copy[j] = sr_track_dup(tracks[j]);
+		n = sr_session_queue_tracks(s->session, copy, count);
+		queued += n;
+		most = MAX(most, n);
+		services_count++;
 	}
+	g_free(copy);
+
+	for (i = 0; i < count; i++)
+		sr_track_free(tracks[i]);
+
+	sr_trace(SR_TRACE_SUBMIT, 0, services_count, queued);
+	/* batches count tracks, not copies */
+	if (most)
+		add_batched(most);
+	return queued;
+}
+
+/* sent once the track is finished */
+void hp_love_current(bool on)
+{
+	if (current && current->playing)
+		current->loved = on;
 }
 
 void hp_love(const char *artist, const char *title, bool on)
@@ -321,58 +906,191 @@ void hp_love(const char *artist, const char *title, bool on)
 	}
 }
 
-void hp_stop(void)
+void hp_stop(hp_source_t *src)
 {
+	bool ended = src->playing != NULL;
+
+	sr_trace(SR_TRACE_STOP, 0, 0, 0);
+	if (finish(src, sr_clock_now()))
+		add_batched(1);
+	if (ended && current == src && now_playing_func)
+		now_playing_func(NULL, false, now_playing_data);
 	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
 		struct service *s = &services[i];
 		if (!s->on)
 			continue;
-		sr_session_pause(s->session);
-		sr_session_store_list(s->session, s->cache);
+		if (current == src)
+			sr_session_now_playing(s->session, NULL);
+		if (s->loaded)
+			sr_session_store_list(s->session, s->cache);
+	}
+}
+
+static gboolean
+export_done(void *data)
+{
+	struct export *e = data;
+
+	g_thread_join(e->thread);
+	exports = g_slist_remove(exports, e);
+	e->func(e->count, e->data);
+	g_free(e);
+	return FALSE;
+}
+
+static void *
+export_thread(void *data)
+{
+	struct export *e = data;
+
+	e->count = sr_session_export(e->session, e->f, e->format,
+			SR_EXPORT_QUEUE | SR_EXPORT_LOVE | SR_EXPORT_HISTORY);
+	if (fclose(e->f) != 0)
+		e->count = -1;
+	e->idle = g_idle_add(export_done, e);
+	return NULL;
+}
+
+/* the history can be big */
+bool hp_export(const char *id, FILE *f, int format,
+		hp_export_func func, void *data)
+{
+	sr_session_t *session = hp_get_session(id);
+	struct export *e;
+
+	if (!session)
+		return false;
+
+	e = g_new0(struct export, 1);
+	e->session = session;
+	e->f = f;
+	e->format = format;
+	e->func = func;
+	e->data = data;
+	exports = g_slist_prepend(exports, e);
+	e->thread = g_thread_create(export_thread, e, TRUE, NULL);
+	return true;
+}
+
+/* safe to call from a signal handler */
+const char *hp_dump_trace(void)
+{
+	if (!trace_file || sr_trace_dump(trace_file) != 0)
+		return NULL;
+	return trace_file;
+}
+
+static struct service *
+find_service(const char *id)
+{
+	for (unsigned i = 0; i < G_N_ELEMENTS(services); i++) {
+		struct service *s = &services[i];
+		if (strcmp(s->id, id) == 0)
+			return s;
 	}
+	return NULL;
+}
+
+sr_history_t *hp_get_history(const char *id)
+{
+	struct service *s = find_service(id);
+	/* set by the loader thread */
+	return s && s->loaded ? s->history : NULL;
+}
+
+sr_charts_t *hp_get_charts(const char *id)
+{
+	struct service *s = find_service(id);
+	return s && s->loaded ? s->charts : NULL;
+}
+
+sr_session_t *hp_get_session(const char *id)
+{
+	struct service *s = find_service(id);
+	return s ? s->session : NULL;
+}
+
+void hp_set_now_playing_cb(hp_now_playing_func func, void *data)
+{
+	now_playing_func = func;
+	now_playing_data = data;
+}
+
+sr_track_t *hp_get_current(bool *loved)
+{
+	if (!current || !current->playing)
+		return NULL;
+	if (loved)
+		*loved = current->loved;
+	return current->playing;
+}
+
+static inline void
+take(char **field, char **value)
+{
+	if (!*value)
+		return;
+	g_free(*field);
+	*field = *value;
+	*value = NULL;
+}
+
+void hp_stage(hp_source_t *src, sr_track_t *t)
+{
+	sr_track_t *staged = src->track;
+
+	take(&staged->artist, &t->artist);
+	take(&staged->title, &t->title);
+	take(&staged->album, &t->album);
+	take(&staged->mbid, &t->mbid);
+	if (t->length)
+		staged->length = t->length;
+	sr_track_free(t);
 }
 
-void hp_set_artist(const char *value)
+void hp_set_artist(hp_source_t *src, const char *value)
 {
-	g_free(track->artist);
-	track->artist = g_strdup(value);
+	g_free(src->track->artist);
+	src->track->artist = g_strdup(value);
 }
 
-void hp_set_title(const char *value)
+void hp_set_title(hp_source_t *src, const char *value)
 {
-	g_free(track->title);
-	track->title = g_strdup(value);
+	g_free(src->track->title);
+	src->track->title = g_strdup(value);
 }
 
-void hp_set_length(int value)
+void hp_set_length(hp_source_t *src, int value)
 {
-	track->length = value;
+	src->track->length = value;
 }
 
-void hp_set_album(const char *value)
+void hp_set_album(hp_source_t *src, const char *value)
 {
-	g_free(track->album);
-	track->album = g_strdup(value);
+	g_free(src->track->album);
+	src->track->album = g_strdup(value);
 }
 
-void hp_set_timestamp(void)
+void hp_set_timestamp(hp_source_t *src)
 {
-	track->timestamp = time(NULL);
+	src->track->timestamp = sr_clock_now();
 }
 
 static gboolean do_next(void *data)
 {
-	next_timer = 0;
-	hp_submit();
+	hp_source_t *src = data;
+	src->next_timer = 0;
+	hp_submit(src);
 	return FALSE;
 }
 
-void hp_next(void)
+void hp_next(hp_source_t *src)
 {
-	hp_set_timestamp();
+	sr_trace(SR_TRACE_NEXT, 0, 0, 0);
+	hp_set_timestamp(src);
 
-	if (next_timer)
-		g_source_remove(next_timer);
+	if (src->next_timer)
+		sr_timeout_remove(src->next_timer);
 
-	next_timer = g_timeout_add_seconds(10, do_next, NULL);
+	src->next_timer = sr_timeout_add_seconds(10, do_next, src);
 }
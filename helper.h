@@ -13,20 +13,48 @@ extern "C" {
 
 #include "scrobble.h"
 #include <stdbool.h>
+#include <stdio.h>
+
+/* what one player is playing, each is staged and committed separately */
+typedef struct hp_source hp_source_t;
+
+/* 't' is NULL when the committed track wasn't valid */
+typedef void (*hp_now_playing_func) (sr_track_t *t, bool loved, void *data);
+
+/* 'count' is -1 when the export failed, or was cut short by hp_deinit() */
+typedef void (*hp_export_func) (int count, void *data);
 
 void hp_init(void);
 void hp_deinit(void);
-void hp_submit(void);
+hp_source_t *hp_source_new(const char *name);
+void hp_source_free(hp_source_t *src);
+
+void hp_submit(hp_source_t *src);
+int hp_submit_tracks(sr_track_t **tracks, unsigned count);
 void hp_love_current(bool on);
 void hp_love(const char *artist, const char *title, bool on);
-void hp_stop(void);
-void hp_next(void);
-
-void hp_set_artist(const char *value);
-void hp_set_title(const char *value);
-void hp_set_length(int value);
-void hp_set_album(const char *value);
-void hp_set_timestamp(void);
+void hp_stop(hp_source_t *src);
+void hp_next(hp_source_t *src);
+void hp_flush(void);
+void hp_set_connected(bool on);
+sr_history_t *hp_get_history(const char *id);
+sr_charts_t *hp_get_charts(const char *id);
+sr_session_t *hp_get_session(const char *id);
+void hp_set_now_playing_cb(hp_now_playing_func func, void *data);
+sr_track_t *hp_get_current(bool *loved);
+const char *hp_dump_trace(void);
+/* in a thread, which closes 'f'; 'func' is called from the main loop */
+bool hp_export(const char *id, FILE *f, int format,
+		hp_export_func func, void *data);
+
+void hp_set_artist(hp_source_t *src, const char *value);
+void hp_set_title(hp_source_t *src, const char *value);
+void hp_set_length(hp_source_t *src, int value);
+void hp_set_album(hp_source_t *src, const char *value);
+void hp_set_timestamp(hp_source_t *src);
+
+/* takes 't'; what is set in it replaces the staged values, nothing is copied */
+void hp_stage(hp_source_t *src, sr_track_t *t);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#include "history.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+/*
+ * The history file is append-only and uses the same record format as the
+ * cache. On open it's scanned once to build two in-memory indexes: every
+ * record by timestamp, and the timestamps of every artist. Both are kept
+ * sorted, so range queries are binary searches.
+ */
+
+/* records read before the lock is released */
+#define FOREACH_BATCH 256
+
+struct entry {
+	unsigned timestamp;
+	long offset;
+};
+
+struct artist {
+	char *name;
+	GArray *timestamps;
+};
+
+struct sr_history {
+	FILE *f;
+	GArray *entries;
+	GHashTable *artists;
+	GMutex *mutex;
+};
+
+/* first element with timestamp >= ts; all elements start with the timestamp */
+static unsigned
+lower_bound(GArray *a,
+		size_t size,
+		unsigned ts)
+{
+	unsigned lo = 0, hi = a->len;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		unsigned cur = *(unsigned *)(a->data + mid * size);
+		if (cur < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static inline unsigned
+upper_index(GArray *a,
+		size_t size,
+		unsigned to)
+{
+	return to ? lower_bound(a, size, to) : a->len;
+}
+
+static void
+free_artist(void *data)
+{
+	struct artist *a = data;
+	g_array_free(a->timestamps, TRUE);
+	free(a);
+}
+
+static void
+index_track(sr_history_t *h,
+		sr_track_t *t,
+		long offset)
+{
+	struct entry e = { .timestamp = t->timestamp, .offset = offset };
+	struct artist *a;
+	unsigned i;
+
+	/* usually appended in order, so this is normally the tail */
+	i = h->entries->len;
+	if (i && g_array_index(h->entries, struct entry, i - 1).timestamp > e.timestamp)
+		i = lower_bound(h->entries, sizeof(e), e.timestamp);
+	g_array_insert_val(h->entries, i, e);
+
+	a = g_hash_table_lookup(h->artists, t->artist);
+	if (!a) {
+		a = calloc(1, sizeof(*a));
+		a->name = g_strdup(t->artist);
+		a->timestamps = g_array_new(FALSE, FALSE, sizeof(unsigned));
+		g_hash_table_insert(h->artists, a->name, a);
+	}
+
+	i = a->timestamps->len;
+	if (i && g_array_index(a->timestamps, unsigned, i - 1) > e.timestamp)
+		i = lower_bound(a->timestamps, sizeof(unsigned), e.timestamp);
+	g_array_insert_val(a->timestamps, i, e.timestamp);
+}
+
+sr_history_t *
+sr_history_open(const char *file)
+{
+	sr_history_t *h;
+	sr_track_t *t;
+	long offset;
+
+	h = calloc(1, sizeof(*h));
+	h->f = fopen(file, "a+");
+	if (!h->f) {
+		free(h);
+		return NULL;
+	}
+	h->entries = g_array_new(FALSE, FALSE, sizeof(struct entry));
+	h->artists = g_hash_table_new_full(g_str_hash, g_str_equal,
+			g_free, free_artist);
+	h->mutex = g_mutex_new();
+
+	rewind(h->f);
+	while (true) {
+		offset = ftell(h->f);
+		t = sr_track_read(h->f);
+		if (!t)
+			break;
+		if (t->artist)
+			index_track(h, t, offset);
+		sr_track_free(t);
+	}
+
+	return h;
+}
+
+void
+sr_history_close(sr_history_t *h)
+{
+	if (!h)
+		return;
+	fclose(h->f);
+	g_array_free(h->entries, TRUE);
+	g_hash_table_destroy(h->artists);
+	g_mutex_free(h->mutex);
+	free(h);
+}
+
+int
+sr_history_append(sr_history_t *h,
+		sr_track_t *t)
+{
+	long offset;
+
+	if (!t->artist)
+		return 1;
+
+	g_mutex_lock(h->mutex);
+	fseek(h->f, 0, SEEK_END);
+	offset = ftell(h->f);
+	sr_track_write(t, h->f);
+	index_track(h, t, offset);
+	g_mutex_unlock(h->mutex);
+
+	return 0;
+}
+
+void
+sr_history_flush(sr_history_t *h)
+{
+	g_mutex_lock(h->mutex);
+	fflush(h->f);
+	g_mutex_unlock(h->mutex);
+}
+
+unsigned
+sr_history_count(sr_history_t *h,
+		unsigned from,
+		unsigned to)
+{
+	unsigned first, last;
+
+	g_mutex_lock(h->mutex);
+	first = lower_bound(h->entries, sizeof(struct entry), from);
+	last = upper_index(h->entries, sizeof(struct entry), to);
+	g_mutex_unlock(h->mutex);
+
+	return last > first ? last - first : 0;
+}
+
+int
+sr_history_foreach(sr_history_t *h,
+		unsigned from,
+		unsigned to,
+		sr_history_func func,
+		void *user_data)
+{
+	unsigned i, n = 0;
+
+	g_mutex_lock(h->mutex);
+	fflush(h->f);
+	i = lower_bound(h->entries, sizeof(struct entry), from);
+	for (; i < upper_index(h->entries, sizeof(struct entry), to); i++) {
+		struct entry e = g_array_index(h->entries, struct entry, i);
+		sr_track_t *t;
+
+		if (fseek(h->f, e.offset, SEEK_SET) != 0)
+			break;
+		t = sr_track_read(h->f);
+		if (!t)
+			break;
+		func(t, user_data);
+		sr_track_free(t);
+
+		if (++n % FOREACH_BATCH)
+			continue;
+
+		/* let appends through; they might shift the entries */
+		g_mutex_unlock(h->mutex);
+		g_mutex_lock(h->mutex);
+		fflush(h->f);
+		i = lower_bound(h->entries, sizeof(struct entry), e.timestamp);
+		/* entries are never removed, and each has its own offset */
+		while (i < h->entries->len &&
+				g_array_index(h->entries, struct entry, i).offset != e.offset)
+			i++;
+	}
+	g_mutex_unlock(h->mutex);
+
+	return 0;
+}
+
+/* meant for small pages, the lock is held throughout */
+unsigned
+sr_history_page(sr_history_t *h,
+		unsigned from,
+		unsigned to,
+		unsigned offset,
+		unsigned count,
+		sr_history_func func,
+		void *user_data)
+{
+	unsigned i, last, n = 0;
+
+	g_mutex_lock(h->mutex);
+	fflush(h->f);
+	i = lower_bound(h->entries, sizeof(struct entry), from);
+	last = upper_index(h->entries, sizeof(struct entry), to);
+	if (last > i && last - i > offset) {
+		i += offset;
+		last = MIN(last, i + count);
+	} else
+		i = last;
+	for (; i < last; i++) {
+		struct entry e = g_array_index(h->entries, struct entry, i);
+		sr_track_t *t;
+
+		if (fseek(h->f, e.offset, SEEK_SET) != 0)
+			break;
+		t = sr_track_read(h->f);
+		if (!t)
+			break;
+		func(t, user_data);
+		sr_track_free(t);
+		n++;
+	}
+	g_mutex_unlock(h->mutex);
+
+	return n;
+}
+
+/*
+ * The returned artist names belong to the history and are valid until the
+ * next append.
+ */
+unsigned
+sr_history_top_artists(sr_history_t *h,
+		unsigned from,
+		unsigned to,
+		struct sr_artist_count *result,
+		unsigned n)
+{
+	GHashTableIter iter;
+	struct artist *a;
+	unsigned count = 0;
+
+	if (!n)
+		return 0;
+
+	g_mutex_lock(h->mutex);
+	g_hash_table_iter_init(&iter, h->artists);
+	while (g_hash_table_iter_next(&iter, NULL, (void **)&a)) {
+		unsigned first, last, c, i;
+
+		first = lower_bound(a->timestamps, sizeof(unsigned), from);
+		last = upper_index(a->timestamps, sizeof(unsigned), to);
+		if (last <= first)
+			continue;
+		c = last - first;
+
+		if (count == n && result[n - 1].count >= c)
+			continue;
+
+		/* insertion into the sorted top-n */
+		i = count < n ? count++ : n - 1;
+		while (i > 0 && result[i - 1].count < c) {
+			result[i] = result[i - 1];
+			i--;
+		}
+		result[i].artist = a->name;
+		result[i].count = c;
+	}
+	g_mutex_unlock(h->mutex);
+
+	return count;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "scrobble.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct sr_artist_count {
+	const char *artist;
+	unsigned count;
+};
+
+typedef void (*sr_history_func) (sr_track_t *t, void *user_data);
+
+sr_history_t *sr_history_open(const char *file);
+void sr_history_close(sr_history_t *h);
+int sr_history_append(sr_history_t *h, sr_track_t *t);
+void sr_history_flush(sr_history_t *h);
+
+/* ranges are [from, to) in unix time */
+unsigned sr_history_count(sr_history_t *h, unsigned from, unsigned to);
+int sr_history_foreach(sr_history_t *h, unsigned from, unsigned to,
+		sr_history_func func, void *user_data);
+/* at most 'count' tracks, skipping the first 'offset' of the range */
+unsigned sr_history_page(sr_history_t *h, unsigned from, unsigned to,
+		unsigned offset, unsigned count,
+		sr_history_func func, void *user_data);
+unsigned sr_history_top_artists(sr_history_t *h, unsigned from, unsigned to,
+		struct sr_artist_count *result, unsigned n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTORY_H */
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+/*
+ * Imports .scrobbler.log files from portable players into the queue cache
+ * of a service, so the daemon submits them the next time it starts. The
+ * daemon must not be running, or it would overwrite the cache on exit.
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "scrobble.h"
+#include "ledger.h"
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s service] [-c cache] <log>...\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	sr_session_t *s;
+	sr_ledger_t *ledger;
+	const char *service = "lastfm";
+	char *cache = NULL, *file;
+	GTimer *timer;
+	double elapsed;
+	unsigned lines = 0, queued = 0;
+	int opt, r = 0;
+
+	while ((opt = getopt(argc, argv, "s:c:")) != -1) {
+		switch (opt) {
+		case 's':
+			service = optarg;
+			break;
+		case 'c':
+			cache = g_strdup(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage(argv[0]);
+
+	g_type_init();
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (!cache)
+		cache = g_build_filename(g_get_user_cache_dir(), "scrobbler", service, NULL);
+
+	s = sr_session_new(SR_LASTFM_URL, "tst", "1.0");
+
+	/* so what was already submitted isn't queued again */
+	file = g_strconcat(cache, ".ledger", NULL);
+	ledger = sr_ledger_open(file, LEDGER_BOUND);
+	g_free(file);
+	sr_session_set_ledger(s, ledger);
+	sr_session_load_list(s, cache);
+
+	timer = g_timer_new();
+
+	for (int i = optind; i < argc; i++) {
+		struct sr_import_stats stats;
+
+		switch (sr_session_import_log(s, argv[i], &stats)) {
+		case 0:
+			break;
+		case 2:
+			fprintf(stderr, "%s: not an AUDIOSCROBBLER/1.1 log\n", argv[i]);
+			r = 1;
+			continue;
+		default:
+			perror(argv[i]);
+			r = 1;
+			continue;
+		}
+		printf("%s: %u lines, %u queued, %u skipped, %u invalid, %u duplicates\n",
+				argv[i], stats.lines, stats.queued, stats.skipped,
+				stats.invalid, stats.duplicates);
+		lines += stats.lines;
+		queued += stats.queued;
+	}
+
+	g_timer_stop(timer);
+	elapsed = g_timer_elapsed(timer, NULL);
+	if (lines && elapsed > 0)
+		printf("%.0f lines/s\n", lines / elapsed);
+
+	if (queued && sr_session_store_list(s, cache)) {
+		fprintf(stderr, "%s: can't store\n", cache);
+		r = 1;
+	}
+
+	g_timer_destroy(timer);
+	sr_session_free(s);
+	sr_ledger_close(ledger);
+	g_free(cache);
+
+	return r;
+}
@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#include "ledger.h"
+#include "clock.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+/*
+ * Only a 64-bit fingerprint of each acknowledged track is kept, in two
+ * generations of half the bound each; when a new one starts, the oldest is
+ * forgotten. Each generation has a Bloom filter in front of the exact set,
+ * so most lookups of tracks that were never acknowledged don't go further.
+ *
+ * The file is a log of fingerprints and acknowledgement times, rewritten
+ * without the forgotten ones on open and on every new generation.
+ */
+
+#define BLOOM_BITS (1 << 16)
+#define BLOOM_HASHES 4
+
+struct record {
+	uint64_t fp;
+	uint32_t time;
+	uint32_t pad;
+};
+
+struct generation {
+	unsigned start;
+	uint32_t bloom[BLOOM_BITS / 32];
+	GHashTable *set; /* fingerprint to time */
+};
+
+struct sr_ledger {
+	char *file;
+	FILE *f;
+	unsigned period;
+	struct generation gens[2]; /* current, previous */
+	GMutex *mutex;
+};
+
+static guint
+fp_hash(const void *key)
+{
+	uint64_t fp = *(const uint64_t *) key;
+	return fp ^ (fp >> 32);
+}
+
+static gboolean
+fp_equal(const void *a,
+		const void *b)
+{
+	return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+/* FNV-1a */
+uint64_t
+sr_ledger_fingerprint(sr_track_t *t)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	const char *strs[] = { t->artist, t->title };
+
+	for (unsigned i = 0; i < G_N_ELEMENTS(strs); i++) {
+		const unsigned char *p = (const unsigned char *) strs[i];
+		for (; p && *p; p++) {
+			h ^= *p;
+			h *= 0x100000001b3ULL;
+		}
+		/* separator */
+		h ^= 0xff;
+		h *= 0x100000001b3ULL;
+	}
+	for (unsigned i = 0; i < 4; i++) {
+		h ^= (t->timestamp >> (i * 8)) & 0xff;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* double hashing from the two halves */
+static inline unsigned
+bloom_bit(uint64_t fp,
+		unsigned i)
+{
+	uint32_t h1 = fp, h2 = (fp >> 32) | 1;
+	return (h1 + i * h2) % BLOOM_BITS;
+}
+
+static void
+gen_reset(struct generation *g,
+		unsigned start)
+{
+	g->start = start;
+	memset(g->bloom, 0, sizeof(g->bloom));
+	g_hash_table_remove_all(g->set);
+}
+
+static void
+gen_insert(struct generation *g,
+		uint64_t fp,
+		unsigned time)
+{
+	uint64_t *key;
+
+	for (unsigned i = 0; i < BLOOM_HASHES; i++) {
+		unsigned bit = bloom_bit(fp, i);
+		g->bloom[bit / 32] |= 1u << (bit % 32);
+	}
+
+	key = g_new(uint64_t, 1);
+	*key = fp;
+	g_hash_table_replace(g->set, key, GUINT_TO_POINTER(time));
+}
+
+static bool
+gen_contains(struct generation *g,
+		uint64_t fp)
+{
+	for (unsigned i = 0; i < BLOOM_HASHES; i++) {
+		unsigned bit = bloom_bit(fp, i);
+		if (!(g->bloom[bit / 32] & (1u << (bit % 32))))
+			return false;
+	}
+	return g_hash_table_lookup_extended(g->set, &fp, NULL, NULL);
+}
+
+static void
+write_gen(struct generation *g,
+		FILE *f)
+{
+	GHashTableIter iter;
+	void *key, *value;
+
+	g_hash_table_iter_init(&iter, g->set);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct record r = { *(uint64_t *) key, GPOINTER_TO_UINT(value), 0 };
+		fwrite(&r, sizeof(r), 1, f);
+	}
+}
+
+/* must be called with the lock */
+static void
+rewrite(sr_ledger_t *l)
+{
+	char *tmp;
+	FILE *f;
+
+	if (l->f) {
+		fclose(l->f);
+		l->f = NULL;
+	}
+
+	tmp = g_strconcat(l->file, ".tmp", NULL);
+	f = fopen(tmp, "wb");
+	if (f) {
+		write_gen(&l->gens[1], f);
+		write_gen(&l->gens[0], f);
+		if (fclose(f) == 0)
+			rename(tmp, l->file);
+		else
+			remove(tmp);
+	}
+	g_free(tmp);
+
+	l->f = fopen(l->file, "ab");
+}
+
+/* must be called with the lock; returns if anything was forgotten */
+static bool
+advance(sr_ledger_t *l,
+		unsigned now)
+{
+	unsigned start = now - now % l->period;
+
+	if (start <= l->gens[0].start)
+		return false;
+
+	if (start - l->gens[0].start == l->period) {
+		/* the current one becomes the previous */
+		struct generation tmp = l->gens[1];
+		l->gens[1] = l->gens[0];
+		l->gens[0] = tmp;
+		gen_reset(&l->gens[0], start);
+	}
+	else {
+		gen_reset(&l->gens[1], start - l->period);
+		gen_reset(&l->gens[0], start);
+	}
+	return true;
+}
+
+sr_ledger_t *
+sr_ledger_open(const char *file,
+		unsigned bound)
+{
+	sr_ledger_t *l;
+	struct record r;
+	unsigned now = sr_clock_now();
+	FILE *f;
+
+	l = calloc(1, sizeof(*l));
+	l->file = g_strdup(file);
+	l->period = MAX(bound / 2, 1);
+	l->mutex = g_mutex_new();
+	for (unsigned i = 0; i < 2; i++)
+		l->gens[i].set = g_hash_table_new_full(fp_hash, fp_equal, g_free, NULL);
+	advance(l, now);
+
+	f = fopen(file, "rb");
+	if (f) {
+		while (fread(&r, sizeof(r), 1, f) == 1) {
+			unsigned start = r.time - r.time % l->period;
+			if (start == l->gens[0].start)
+				gen_insert(&l->gens[0], r.fp, r.time);
+			else if (start == l->gens[1].start)
+				gen_insert(&l->gens[1], r.fp, r.time);
+		}
+		fclose(f);
+	}
+
+	/* drops the forgotten ones, and whatever was cut short */
+	rewrite(l);
+
+	return l;
+}
+
+void
+sr_ledger_close(sr_ledger_t *l)
+{
+	if (!l)
+		return;
+	if (l->f)
+		fclose(l->f);
+	for (unsigned i = 0; i < 2; i++)
+		g_hash_table_destroy(l->gens[i].set);
+	g_mutex_free(l->mutex);
+	g_free(l->file);
+	free(l);
+}
+
+void
+sr_ledger_add(sr_ledger_t *l,
+		sr_track_t *t)
+{
+	unsigned now = sr_clock_now();
+	struct record r = { sr_ledger_fingerprint(t), now, 0 };
+
+	g_mutex_lock(l->mutex);
+	if (advance(l, now))
+		rewrite(l);
+	gen_insert(&l->gens[0], r.fp, now);
+	if (l->f)
+		fwrite(&r, sizeof(r), 1, l->f);
+	g_mutex_unlock(l->mutex);
+}
+
+void
+sr_ledger_flush(sr_ledger_t *l)
+{
+	g_mutex_lock(l->mutex);
+	if (l->f)
+		fflush(l->f);
+	g_mutex_unlock(l->mutex);
+}
+
+int
+sr_ledger_contains(sr_ledger_t *l,
+		sr_track_t *t)
+{
+	uint64_t fp = sr_ledger_fingerprint(t);
+	bool found;
+
+	g_mutex_lock(l->mutex);
+	found = gen_contains(&l->gens[0], fp) || gen_contains(&l->gens[1], fp);
+	g_mutex_unlock(l->mutex);
+
+	return found;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include "scrobble.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the server refuses older tracks anyway */
+#define LEDGER_BOUND (14 * 24 * 60 * 60)
+
+/* remembers acknowledged tracks for at least 'bound' seconds */
+sr_ledger_t *sr_ledger_open(const char *file, unsigned bound);
+void sr_ledger_close(sr_ledger_t *l);
+void sr_ledger_add(sr_ledger_t *l, sr_track_t *t);
+void sr_ledger_flush(sr_ledger_t *l);
+int sr_ledger_contains(sr_ledger_t *l, sr_track_t *t);
+/* artist, title and timestamp */
+uint64_t sr_ledger_fingerprint(sr_track_t *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LEDGER_H */
@@ -24,6 +24,15 @@ static GMainLoop *main_loop;
 
 static struct sr_service *dbus_service;
 
+static void
+now_playing_cb(sr_track_t *t,
+		bool loved,
+		void *data)
+{
+	if (dbus_service)
+		sr_service_now_playing(dbus_service, t, loved);
+}
+
 static void
 metadata_callback(MafwRenderer *self,
 		const gchar *object_id,
@@ -31,8 +40,15 @@ metadata_callback(MafwRenderer *self,
 		void *user_data,
 		const GError *error)
 {
-	hp_submit();
-	sr_service_next(dbus_service);
+	hp_source_t *src;
+
+	/* the renderer might have been removed while waiting */
+	src = g_object_get_data(user_data, "scrobbler-source");
+	if (src) {
+		hp_submit(src);
+		sr_service_next(dbus_service);
+	}
+	g_object_unref(user_data);
 }
 
 static void
@@ -41,18 +57,19 @@ metadata_changed_cb(MafwRenderer *renderer,
 		GValueArray *value_array,
 		void *data)
 {
+	hp_source_t *src = data;
 	GValue *value = g_value_array_get_nth(value_array, 0);
 	if (strcmp(name, "artist") == 0)
-		hp_set_artist(g_value_get_string(value));
+		hp_set_artist(src, g_value_get_string(value));
 	else if (strcmp(name, "title") == 0)
-		hp_set_title(g_value_get_string(value));
+		hp_set_title(src, g_value_get_string(value));
 	else if (strcmp(name, "duration") == 0)
-		hp_set_length(g_value_get_int64(value));
+		hp_set_length(src, g_value_get_int64(value));
 	else if (strcmp(name, "album") == 0)
-		hp_set_album(g_value_get_string(value));
+		hp_set_album(src, g_value_get_string(value));
 	else if (strcmp(name, "video-codec") == 0)
 		/* skip */
-		hp_set_title(NULL);
+		hp_set_title(src, NULL);
 }
 
 static void
@@ -62,13 +79,13 @@ state_changed_cb(MafwRenderer *renderer,
 {
 	switch (state) {
 	case Playing:
-		hp_set_timestamp();
+		hp_set_timestamp(user_data);
 		mafw_renderer_get_current_metadata(renderer,
 				metadata_callback,
-				user_data);
+				g_object_ref(renderer));
 		break;
 	case Stopped:
-		hp_stop();
+		hp_stop(user_data);
 		break;
 	default:
 		break;
@@ -81,28 +98,51 @@ renderer_added_cb(MafwRegistry *registry,
 		void *user_data)
 {
 	const gchar *name;
+	hp_source_t *src;
 
 	if (!MAFW_IS_RENDERER(renderer))
 		return;
 
 	name = mafw_extension_get_name(MAFW_EXTENSION(renderer));
 
-	if (strcmp(name, "Mafw-Gst-Renderer") != 0)
-		return;
+	/* each renderer stages its own track */
+	src = hp_source_new(name);
+	g_object_set_data(renderer, "scrobbler-source", src);
 
 	g_signal_connect(renderer,
 			"state-changed",
 			G_CALLBACK(state_changed_cb),
-			user_data);
+			src);
 	g_signal_connect(renderer,
 			"metadata-changed",
 			G_CALLBACK(metadata_changed_cb),
-			user_data);
+			src);
+}
+
+static void
+renderer_removed_cb(MafwRegistry *registry,
+		GObject *renderer,
+		void *user_data)
+{
+	hp_source_t *src;
+
+	src = g_object_get_data(renderer, "scrobbler-source");
+	if (!src)
+		return;
+
+	g_signal_handlers_disconnect_matched(renderer, G_SIGNAL_MATCH_DATA,
+			0, 0, NULL, NULL, src);
+	g_object_set_data(renderer, "scrobbler-source", NULL);
+	hp_source_free(src);
 }
 
 static void
 signal_handler(int signal)
 {
+	if (signal == SIGUSR1) {
+		hp_dump_trace();
+		return;
+	}
 	g_main_loop_quit(main_loop);
 }
 
@@ -112,6 +152,7 @@ int main(void)
 	MafwRegistry *registry;
 
 	hp_init();
+	hp_set_now_playing_cb(now_playing_cb, NULL);
 
 	registry = MAFW_REGISTRY(mafw_registry_get_instance());
 	if (!registry)
@@ -124,10 +165,14 @@ int main(void)
 	g_signal_connect(registry,
 			"renderer-added",
 			G_CALLBACK(renderer_added_cb), NULL);
+	g_signal_connect(registry,
+			"renderer-removed",
+			G_CALLBACK(renderer_removed_cb), NULL);
 
 	dbus_service = g_object_new(SR_SERVICE_TYPE, NULL);
 
 	signal(SIGINT, signal_handler);
+	signal(SIGUSR1, signal_handler);
 
 	main_loop = g_main_loop_new(NULL, FALSE);
 	g_main_loop_run(main_loop);
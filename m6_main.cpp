@@ -3,6 +3,7 @@
 
 #include "m6_main.h"
 #include "helper.h"
+#include "scrobble.hpp"
 
 #include <signal.h>
 
@@ -23,6 +24,7 @@ bool Listener::init(void)
 	shared->initTracking(registry);
 
 	renderer = registry->renderer("mafw_gst_renderer");
+	source = hp_source_new("mafw_gst_renderer");
 
 	if (!connect(renderer, SIGNAL(mediaChanged(int, const MafwContent&)),
 			this, SLOT(next(void))))
@@ -58,35 +60,49 @@ tk_fail:
 
 void Listener::next(void)
 {
-	hp_next();
+	hp_next(source);
 }
 
 void Listener::state_changed(MafwRenderer::State state)
 {
 	switch (state) {
 	case MafwRenderer::Playing:
-		hp_next();
+		hp_next(source);
 		break;
 	case MafwRenderer::Stopped:
 	case MafwRenderer::Paused:
-		hp_stop();
+		hp_stop(source);
 		break;
 	default:
 		break;
 	}
 }
 
+/* straight from UTF-16, without an intermediate QByteArray */
+static sr::String utf8(const QString &str)
+{
+	return sr::String(g_utf16_to_utf8((const gunichar2 *) str.utf16(),
+				str.size(), NULL, NULL, NULL));
+}
+
 void Listener::metadata_changed(const QString& name, const QList<QVariant>& values)
 {
 	QVariant value = values[0];
+	sr::Track t;
+
 	if (name == "artist")
-		hp_set_artist(value.toString().toUtf8());
+		t.set_artist(utf8(value.toString()));
 	else if (name == "title")
-		hp_set_title(value.toString().toUtf8());
+		t.set_title(utf8(value.toString()));
 	else if (name == "duration")
-		hp_set_length(value.toLongLong());
+		t.set_length(value.toLongLong());
 	else if (name == "album")
-		hp_set_album(value.toString().toUtf8());
+		t.set_album(utf8(value.toString()));
+	else
+		return;
+
+	/* from here on it's the same track that gets queued */
+	hp_stage(source, t.release());
 }
 
 static const QString ID_QUERY =
@@ -124,6 +140,10 @@ void Listener::got_info(QList<QStringList> rows, bool foo)
 
 static void signal_handler(int signal)
 {
+	if (signal == SIGUSR1) {
+		hp_dump_trace();
+		return;
+	}
 	QCoreApplication::exit(0);
 }
 
@@ -133,6 +153,7 @@ int main(int argc, char *argv[])
 
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
+	signal(SIGUSR1, signal_handler);
 
 	hp_init();
 
@@ -7,6 +7,7 @@ class MafwShared;
 class MafwRegistry;
 class MafwTrackerModelFactory;
 class MafwTrackerModelConnection;
+struct hp_source;
 
 class Listener : public QObject
 {
@@ -30,6 +31,7 @@ private:
 	MafwShared *shared;
 	MafwRegistry *registry;
 	MafwRenderer *renderer;
+	struct hp_source *source;
 
 	MafwTrackerModelFactory *tk_factory;
 	MafwTrackerModelConnection *tk_conn;
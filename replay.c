@@ -0,0 +1,534 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+/*
+ * Replays recorded renderer events through the same hp_* calls m5_main.c
+ * does, against a local stand-in for the scrobbling servers, and reports
+ * what it cost.
+ *
+ * The recording has one event per line, prefixed by its offset in seconds
+ * from the start:
+ *
+ *   0 meta artist Daft Punk
+ *   0 meta title Around the World
+ *   0 meta duration 429
+ *   0 state playing
+ *   429 state stopped
+ *
+ * Empty lines and lines starting with '#' are ignored. Events from more than
+ * one renderer can be told apart by adding its name to the offset, as in
+ * "12@radio state playing"; each name gets its own source.
+ *
+ * By default the session runs on a virtual clock, which jumps from one
+ * event to the next, and the real main loop is only given a few
+ * milliseconds after each event to exchange requests with the stand-in.
+ * With -s, events are replayed in real time divided by the given speed.
+ *
+ * The configuration and caches go to a new temporary directory, unless one
+ * is given with -C. Reusing it, with a fixed port (-p), shows the effect of
+ * the persisted state, such as resumed handshakes.
+ */
+
+#include <glib.h>
+#include <libsoup/soup.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "helper.h"
+#include "clock.h"
+
+enum event_type {
+	EVENT_PLAYING,
+	EVENT_PAUSED,
+	EVENT_STOPPED,
+	EVENT_META,
+};
+
+struct event {
+	unsigned time;
+	char *source;
+	enum event_type type;
+	char *name;
+	char *value;
+};
+
+static const char *service_ids[] = { "lastfm", "librefm" };
+
+static GMainLoop *main_loop;
+static GPtrArray *events;
+static GHashTable *sources;
+static unsigned current;
+static double speed; /* 0 means virtual time */
+static unsigned drain = 5;
+static unsigned settle_time = 2;
+static unsigned batch_size = 1;
+
+static unsigned long allocs;
+
+static struct {
+	unsigned handshakes;
+	unsigned now_playing;
+	unsigned submits;
+	unsigned web;
+	unsigned scrobbles;
+} requests;
+
+static void *
+count_malloc(gsize n)
+{
+	allocs++;
+	return malloc(n);
+}
+
+static void *
+count_realloc(void *p, gsize n)
+{
+	if (!p)
+		allocs++;
+	return realloc(p, n);
+}
+
+static GMemVTable count_vtable = {
+	.malloc = count_malloc,
+	.realloc = count_realloc,
+	.free = free,
+};
+
+static void
+free_event(void *data)
+{
+	struct event *e = data;
+	g_free(e->source);
+	g_free(e->name);
+	g_free(e->value);
+	g_free(e);
+}
+
+static struct event *
+parse_event(char *line)
+{
+	struct event *e;
+	char **v, *end;
+
+	g_strstrip(line);
+	if (!line[0] || line[0] == '#')
+		return NULL;
+
+	v = g_strsplit(line, " ", 4);
+	if (g_strv_length(v) < 3)
+		goto bad;
+
+	e = g_new0(struct event, 1);
+	e->time = strtoul(v[0], &end, 10);
+	e->source = g_strdup(*end == '@' ? end + 1 : "default");
+
+	if (strcmp(v[1], "state") == 0) {
+		if (strcmp(v[2], "playing") == 0)
+			e->type = EVENT_PLAYING;
+		else if (strcmp(v[2], "paused") == 0)
+			e->type = EVENT_PAUSED;
+		else if (strcmp(v[2], "stopped") == 0)
+			e->type = EVENT_STOPPED;
+		else {
+			free_event(e);
+			goto bad;
+		}
+	}
+	else if (strcmp(v[1], "meta") == 0) {
+		e->type = EVENT_META;
+		e->name = g_strdup(v[2]);
+		e->value = g_strdup(v[3]);
+	}
+	else {
+		free_event(e);
+		goto bad;
+	}
+
+	g_strfreev(v);
+	return e;
+bad:
+	g_strfreev(v);
+	g_warning("bad event: %s", line);
+	return NULL;
+}
+
+static bool
+load_events(const char *file)
+{
+	FILE *f;
+	char line[0x400];
+
+	f = fopen(file, "r");
+	if (!f)
+		return false;
+
+	events = g_ptr_array_new();
+	while (fgets(line, sizeof(line), f)) {
+		struct event *e = parse_event(line);
+		if (e)
+			g_ptr_array_add(events, e);
+	}
+
+	fclose(f);
+	return true;
+}
+
+static hp_source_t *
+get_source(const char *name)
+{
+	hp_source_t *src;
+
+	src = g_hash_table_lookup(sources, name);
+	if (!src) {
+		src = hp_source_new(name);
+		g_hash_table_insert(sources, g_strdup(name), src);
+	}
+	return src;
+}
+
+/* what m5_main.c does for each renderer signal */
+static void
+dispatch(struct event *e)
+{
+	hp_source_t *src = get_source(e->source);
+
+	switch (e->type) {
+	case EVENT_PLAYING:
+		hp_set_timestamp(src);
+		hp_submit(src);
+		break;
+	case EVENT_STOPPED:
+		hp_stop(src);
+		break;
+	case EVENT_PAUSED:
+		break;
+	case EVENT_META:
+		if (strcmp(e->name, "artist") == 0)
+			hp_set_artist(src, e->value);
+		else if (strcmp(e->name, "title") == 0)
+			hp_set_title(src, e->value);
+		else if (strcmp(e->name, "duration") == 0)
+			hp_set_length(src, e->value ? atoi(e->value) : 0);
+		else if (strcmp(e->name, "album") == 0)
+			hp_set_album(src, e->value);
+		else if (strcmp(e->name, "video-codec") == 0)
+			hp_set_title(src, NULL);
+		break;
+	}
+}
+
+static gboolean
+quit(void *data)
+{
+	g_main_loop_quit(main_loop);
+	return FALSE;
+}
+
+/* let the real main loop run for a while */
+static void
+settle(unsigned msec)
+{
+	g_timeout_add(msec, quit, NULL);
+	g_main_loop_run(main_loop);
+}
+
+static void
+play_virtual(void)
+{
+	unsigned last = 0;
+
+	/* caches load in the background */
+	settle(100);
+
+	while (current < events->len) {
+		struct event *e = g_ptr_array_index(events, current);
+
+		if (e->time > last) {
+			sr_clock_advance((e->time - last) * 1000);
+			last = e->time;
+		}
+		do {
+			dispatch(g_ptr_array_index(events, current++));
+		} while (current < events->len &&
+				((struct event *) g_ptr_array_index(events, current))->time <= last);
+
+		settle(settle_time);
+	}
+
+	hp_flush();
+	sr_clock_advance(drain * 1000);
+	settle(100);
+}
+
+static gboolean
+play(void *data)
+{
+	struct event *e;
+	unsigned delay;
+
+	do {
+		e = g_ptr_array_index(events, current++);
+		dispatch(e);
+	} while (current < events->len &&
+			((struct event *) g_ptr_array_index(events, current))->time <= e->time);
+
+	if (current == events->len) {
+		hp_flush();
+		g_timeout_add_seconds(drain, quit, NULL);
+		return FALSE;
+	}
+
+	delay = ((struct event *) g_ptr_array_index(events, current))->time - e->time;
+	g_timeout_add(delay * 1000 / speed, play, NULL);
+	return FALSE;
+}
+
+/* local stand-in */
+
+static void
+server_cb(SoupServer *server,
+		SoupMessage *msg,
+		const char *path,
+		GHashTable *query,
+		SoupClientContext *client,
+		void *user_data)
+{
+	const char *base = user_data;
+	char *body;
+
+	if (query && g_hash_table_lookup(query, "hs")) {
+		requests.handshakes++;
+		body = g_strdup_printf("OK\nreplay\n%snp\n%ssubmit\n", base, base);
+	}
+	else if (strcmp(path, "/np") == 0) {
+		requests.now_playing++;
+		body = g_strdup("OK\n");
+	}
+	else if (strcmp(path, "/submit") == 0) {
+		const char *p = msg->request_body->data;
+		requests.submits++;
+		while (p && (p = strstr(p, "&a["))) {
+			requests.scrobbles++;
+			p++;
+		}
+		body = g_strdup("OK\n");
+	}
+	else {
+		requests.web++;
+		body = g_strdup("<lfm status=\"ok\"><session><key>replay</key></session></lfm>\n");
+	}
+
+	soup_message_set_status(msg, SOUP_STATUS_OK);
+	soup_message_set_response(msg, "text/plain", SOUP_MEMORY_TAKE, body, strlen(body));
+}
+
+static void
+write_conf(const char *dir,
+		const char *base)
+{
+	GKeyFile *keyfile;
+	char *url, *api_url, *data, *file;
+
+	keyfile = g_key_file_new();
+	url = g_strdup_printf("%s?hs=true", base);
+	api_url = g_strdup_printf("%s2.0/", base);
+	for (unsigned i = 0; i < G_N_ELEMENTS(service_ids); i++) {
+		const char *id = service_ids[i];
+		g_key_file_set_string(keyfile, id, "username", "replay");
+		g_key_file_set_string(keyfile, id, "password", "replay");
+		g_key_file_set_string(keyfile, id, "url", url);
+		g_key_file_set_string(keyfile, id, "api-url", api_url);
+	}
+	g_key_file_set_integer(keyfile, "general", "batch-size", batch_size);
+	data = g_key_file_to_data(keyfile, NULL, NULL);
+
+	/* wherever the helper looks for it */
+	file = g_build_filename(dir, ".osso", NULL);
+	g_mkdir_with_parents(file, 0755);
+	g_free(file);
+	file = g_build_filename(dir, ".osso", "scrobbler", NULL);
+	g_file_set_contents(file, data, -1, NULL);
+	g_free(file);
+	file = g_build_filename(dir, "scrobbler", NULL);
+	g_file_set_contents(file, data, -1, NULL);
+	g_free(file);
+
+	g_free(data);
+	g_free(url);
+	g_free(api_url);
+	g_key_file_free(keyfile);
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-s speed] [-d drain-seconds] [-q settle-msec] "
+			"[-C dir] [-p port] [-b batch-size] <recording>\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	SoupServer *server;
+	char *dir = NULL, *base;
+	unsigned port = 0;
+	struct rusage usage_end;
+	GTimer *timer;
+	unsigned long start_allocs;
+	double cpu;
+	unsigned tracks = 0, windows = 0, span;
+	int opt;
+
+	/* read by GLib once, before anything else it does */
+	putenv("G_SLICE=always-malloc");
+	g_mem_set_vtable(&count_vtable);
+
+	while ((opt = getopt(argc, argv, "s:d:q:C:p:b:")) != -1) {
+		switch (opt) {
+		case 's':
+			speed = atof(optarg);
+			break;
+		case 'd':
+			drain = atoi(optarg);
+			break;
+		case 'q':
+			settle_time = atoi(optarg);
+			break;
+		case 'C':
+			g_free(dir);
+			dir = g_strdup(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'b':
+			batch_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (optind >= argc || speed < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!load_events(argv[optind])) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (!events->len)
+		return 0;
+	for (unsigned i = 0; i < events->len; i++)
+		if (((struct event *) g_ptr_array_index(events, i))->type == EVENT_PLAYING)
+			tracks++;
+
+	/* keep the real configuration and caches out of it */
+	if (!dir) {
+		dir = g_build_filename(g_get_tmp_dir(), "scrobbler-replay-XXXXXX", NULL);
+		if (!g_mkdtemp(dir)) {
+			perror(dir);
+			return 1;
+		}
+	}
+	else
+		g_mkdir_with_parents(dir, 0755);
+	g_setenv("HOME", dir, TRUE);
+	g_setenv("XDG_CONFIG_HOME", dir, TRUE);
+	g_setenv("XDG_CACHE_HOME", dir, TRUE);
+
+	if (!speed)
+		sr_clock_set_virtual(time(NULL));
+
+	hp_init();
+	sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	server = soup_server_new(SOUP_SERVER_PORT, port, NULL);
+	if (!server) {
+		fprintf(stderr, "can't listen on port %u\n", port);
+		return 1;
+	}
+	base = g_strdup_printf("http://127.0.0.1:%u/", soup_server_get_port(server));
+	soup_server_add_handler(server, NULL, server_cb, base, NULL);
+	soup_server_run_async(server);
+
+	write_conf(dir, base);
+	hp_set_connected(true);
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	timer = g_timer_new();
+	start_allocs = allocs;
+
+	if (!speed)
+		play_virtual();
+	else {
+		g_idle_add(play, NULL);
+		g_main_loop_run(main_loop);
+	}
+
+	for (unsigned i = 0; i < G_N_ELEMENTS(service_ids); i++) {
+		struct sr_session_stats stats;
+		sr_session_get_stats(hp_get_session(service_ids[i]), &stats);
+		printf("%s: resumed handshakes %u, avoided %u, reconnect to first ack %ums"
+				" (%u hosts warmed up)\n",
+				service_ids[i], stats.resumed, stats.handshakes_avoided,
+				stats.reconnect_to_ack, stats.warm_ups);
+		printf("%s: now-playing latency p50 %ums, p90 %ums, max %ums\n",
+				service_ids[i], stats.np_latency_p50,
+				stats.np_latency_p90, stats.np_latency_max);
+		printf("%s: batch limit %u, %u rejected, %u quarantined, %u already acked\n",
+				service_ids[i], stats.batch_limit, stats.rejected,
+				stats.quarantined, stats.already_acked);
+		if (stats.stalls)
+			printf("%s: %u stalled requests, %ums in total, longest %ums\n",
+					service_ids[i], stats.stalls, stats.stall_time,
+					stats.longest_stall);
+		windows += stats.windows;
+	}
+
+	/* frees the sources too */
+	hp_deinit();
+	g_hash_table_destroy(sources);
+
+	getrusage(RUSAGE_SELF, &usage_end);
+	cpu = usage_end.ru_utime.tv_sec + usage_end.ru_utime.tv_usec / 1e6 +
+		usage_end.ru_stime.tv_sec + usage_end.ru_stime.tv_usec / 1e6;
+
+	printf("events: %u, tracks: %u, copies: %u, scrobbles acked: %u\n",
+			events->len, tracks, sr_track_copies(), requests.scrobbles);
+	printf("requests: handshake %u, now-playing %u, submit %u, web-service %u\n",
+			requests.handshakes, requests.now_playing,
+			requests.submits, requests.web);
+	span = ((struct event *) g_ptr_array_index(events, events->len - 1))->time + drain;
+	printf("radio windows: %u, %.1f per hour\n",
+			windows, windows * 3600.0 / MAX(span, 1));
+	printf("wall: %.3fs, cpu: %.3fs, allocations: %lu\n",
+			g_timer_elapsed(timer, NULL), cpu, allocs - start_allocs);
+	if (requests.scrobbles) {
+		unsigned total = requests.handshakes + requests.now_playing +
+			requests.submits + requests.web;
+		printf("per scrobble: %.2f requests, %.1f allocations, %.3fms cpu\n",
+				(double) total / requests.scrobbles,
+				(double) (allocs - start_allocs) / requests.scrobbles,
+				cpu * 1000 / requests.scrobbles);
+	}
+
+	g_timer_destroy(timer);
+	g_object_unref(server);
+	g_main_loop_unref(main_loop);
+	g_ptr_array_foreach(events, (GFunc) free_event, NULL);
+	g_ptr_array_free(events, TRUE);
+	g_free(base);
+	g_free(dir);
+
+	return 0;
+}
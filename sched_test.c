@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+/*
+ * Checks the request scheduler: a now-playing must not wait behind love
+ * and backlog requests. Nothing is actually sent, the main loop never
+ * runs.
+ */
+
+#include "scrobble.c"
+
+#define URL "http://127.0.0.1:1/"
+
+static void
+nop_cb(SoupSession *session,
+		SoupMessage *message,
+		void *user_data)
+{
+}
+
+static bool
+started(struct sr_session_priv *priv,
+		int kind)
+{
+	for (GList *c = priv->requests; c; c = c->next) {
+		struct request *r = c->data;
+		if (r->kind == kind)
+			return true;
+	}
+	return false;
+}
+
+static void
+queue(sr_session_t *s,
+		int kind)
+{
+	queue_message(s, soup_message_new("POST", URL), kind, nop_cb);
+}
+
+int main(void)
+{
+	sr_session_t *s;
+	struct sr_session_priv *priv;
+	int failed = 0;
+
+	g_type_init();
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	s = sr_session_new(URL, "tst", "1.0");
+	priv = s->priv;
+
+	queue(s, SR_REQUEST_WS);
+	queue(s, SR_REQUEST_SUBMIT);
+	queue(s, SR_REQUEST_NOW_PLAYING);
+
+	if (!started(priv, SR_REQUEST_NOW_PLAYING)) {
+		fprintf(stderr, "now-playing waits behind love and submit\n");
+		failed++;
+	}
+	if (!started(priv, SR_REQUEST_WS)) {
+		fprintf(stderr, "love didn't start\n");
+		failed++;
+	}
+	if (started(priv, SR_REQUEST_SUBMIT)) {
+		fprintf(stderr, "submit took the last connection\n");
+		failed++;
+	}
+	if (priv->running != g_list_length(priv->requests)) {
+		fprintf(stderr, "%u running, %u in the list\n",
+				priv->running, g_list_length(priv->requests));
+		failed++;
+	}
+
+	sr_session_free(s);
+
+	return failed ? 1 : 0;
+}
@@ -5,17 +5,39 @@
  */
 
 #include "scrobble.h"
+#include "history.h"
+#include "charts.h"
+#include "ledger.h"
+#include "trace.h"
+#include "clock.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <libsoup/soup.h>
 
+/* request classes, most urgent first */
+enum {
+	PRIO_NOW_PLAYING, /* and handshakes, which everything waits for */
+	PRIO_LOVE,
+	PRIO_BACKLOG,
+	PRIO_LAST,
+};
+
+/* now-playing latencies kept for the percentiles */
+#define NP_SAMPLES 64
+
 struct sr_session_priv {
+	unsigned id;
 	char *url;
 	char *client_id;
 	char *client_ver;
@@ -24,11 +46,23 @@ struct sr_session_priv {
 	GMutex *queue_mutex;
 	SoupSession *soup;
 	int handshake_delay;
+	bool handshaking;
+	unsigned retry_timer; /* at most one */
 	char *session_id;
 	char *now_playing_url;
 	char *submit_url;
 	int hard_failure_count;
 	int submit_count;
+	int submit_offset; /* 1 while a suspect at the head is skipped */
+	int batch_limit; /* tracks */
+	uint64_t submit_time;
+	bool skip_head;
+	sr_track_t *suspect; /* only compared, never followed */
+	unsigned suspect_time;
+	int strikes;
+	unsigned flushes, strike_flush;
+	bool on_trial; /* the suspect goes alone once more */
+	char *quarantine;
 	sr_track_t *last_track;
 	int np_timer;
 
@@ -40,11 +74,350 @@ struct sr_session_priv {
 	GQueue *love_queue;
 	GMutex *love_queue_mutex;
 	bool api_problems;
+	bool loving; /* one love request at a time */
+	bool authing;
+
+	sr_history_t *history;
+	sr_charts_t *charts;
+	sr_ledger_t *ledger;
+
+	/* retention */
+	unsigned max_age;
+	unsigned max_count;
+	char *archive;
+
+	/* memory accounting */
+	size_t queue_bytes;
+	size_t love_bytes;
+	size_t request_bytes;
+	size_t strings_bytes; /* updated by whoever changes them */
+	size_t budget;
+	int budget_policy;
+	char *spill;
+	unsigned spill_oldest; /* 0 when nothing is spilled */
+	GHashTable *returned; /* fingerprints of what came back from the spill */
+
+	/* handshake cache */
+	char *handshake_file;
+	unsigned handshake_validity;
+	unsigned handshake_time;
+
+	uint64_t reconnect_time;
+
+	/* watchdog */
+	GList *requests; /* in flight */
+	unsigned timeouts[SR_REQUEST_LAST]; /* sec */
+	unsigned watchdog;
+
+	/* scheduler */
+	GQueue pending[PRIO_LAST];
+	unsigned in_flight[PRIO_LAST];
+	unsigned running; /* all of them */
+	unsigned np_latency[NP_SAMPLES]; /* msec, a ring */
+	unsigned np_samples;
+	bool freeing; /* cancelled requests only clean up */
+
+	/* don't start requests on our own, wait for a flush */
+	bool held;
+	bool np_pending;
+
+	struct sr_session_stats stats;
 };
 
+/* the tracks at the head that are in flight, or skipped meanwhile */
+static inline int
+in_flight_tracks(struct sr_session_priv *priv)
+{
+	return priv->submit_offset + priv->submit_count;
+}
+
+static guint
+fp_hash(const void *key)
+{
+	uint64_t fp = *(const uint64_t *) key;
+	return fp ^ (fp >> 32);
+}
+
+static gboolean
+fp_equal(const void *a,
+		const void *b)
+{
+	return *(const uint64_t *) a == *(const uint64_t *) b;
+}
+
+static size_t strings_size(struct sr_session_priv *priv);
+static void strings_changed(struct sr_session_priv *priv);
 static void now_playing(sr_session_t *s, sr_track_t *t);
+static void send_now_playing(sr_session_t *s);
 static void ws_auth(sr_session_t *s);
-static void ws_love(sr_session_t *s, bool on);
+static void ws_love(sr_session_t *s);
+static void request_handshake(sr_session_t *s);
+
+static volatile int session_count;
+
+/*
+ * The radio stays up for a while after the last request; anything sent
+ * within that tail doesn't cost another wake-up. Shared by all sessions,
+ * requests are only started from the main loop.
+ */
+#define RADIO_TAIL (15 * 1000)
+
+static uint64_t last_activity;
+
+/* seconds a now-playing is worth sending, when the length is unknown */
+#define NP_MAX_AGE (5 * 60)
+
+/* the protocol's limit */
+#define MAX_BATCH 50
+/* for the body of a submission */
+#define SUBMIT_BYTES (8 * 1024)
+/* msec; slower submissions make the batches smaller */
+#define SLOW_SUBMIT (5 * 1000)
+/* flushes refusing the head alone before the others go without it */
+#define QUARANTINE_STRIKES 3
+
+/* how often stalled requests are looked for, in seconds */
+#define WATCHDOG_PERIOD 5
+
+static const unsigned default_timeouts[SR_REQUEST_LAST] = {
+	[SR_REQUEST_HANDSHAKE] = 30,
+	[SR_REQUEST_SUBMIT] = 60,
+	[SR_REQUEST_NOW_PLAYING] = 30,
+	[SR_REQUEST_WS] = 30,
+};
+
+/*
+ * libsoup opens two connections per host; the last one is kept for the
+ * urgent class, and each class has a single request in flight.
+ */
+#define MAX_IN_FLIGHT 2
+
+static const unsigned class_limits[PRIO_LAST] = { 1, 1, 1 };
+
+/* msec a request can wait before it goes ahead of more urgent ones */
+#define STARVATION_LIMIT (30 * 1000)
+
+struct request {
+	sr_session_t *s;
+	SoupMessage *message;
+	SoupSessionCallback callback;
+	int kind;
+	int prio;
+	uint64_t queued;
+	uint64_t start;
+};
+
+static inline int
+request_prio(int kind)
+{
+	switch (kind) {
+	case SR_REQUEST_WS:
+		return PRIO_LOVE;
+	case SR_REQUEST_SUBMIT:
+		return PRIO_BACKLOG;
+	default:
+		return PRIO_NOW_PLAYING;
+	}
+}
+
+/*
+ * Cancelled requests get their callback with SOUP_STATUS_REQUEST_TIMEOUT,
+ * which takes them through the usual failure path.
+ */
+static gboolean
+watchdog(void *data)
+{
+	sr_session_t *s = data;
+	struct sr_session_priv *priv = s->priv;
+	uint64_t now = sr_clock_monotonic();
+	GList *c, *stalled = NULL;
+
+	for (c = priv->requests; c; c = c->next) {
+		struct request *r = c->data;
+		unsigned timeout = priv->timeouts[r->kind];
+		if (timeout && now - r->start >= timeout * 1000)
+			stalled = g_list_prepend(stalled, r);
+	}
+
+	for (c = stalled; c; c = c->next) {
+		struct request *r = c->data;
+		unsigned stall = now - r->start;
+
+		priv->stats.stalls++;
+		priv->stats.stall_time += stall;
+		if (stall > priv->stats.longest_stall)
+			priv->stats.longest_stall = stall;
+		sr_trace(SR_TRACE_STALL, priv->id, r->kind, stall);
+
+		/* frees 'r' */
+		soup_session_cancel_message(priv->soup, r->message,
+				SOUP_STATUS_REQUEST_TIMEOUT);
+	}
+	g_list_free(stalled);
+
+	if (priv->requests)
+		return true;
+	priv->watchdog = 0;
+	return false;
+}
+
+static void dispatch(sr_session_t *s);
+
+static void
+request_done(SoupSession *session,
+		SoupMessage *message,
+		void *user_data)
+{
+	struct request *r = user_data;
+	sr_session_t *s = r->s;
+	struct sr_session_priv *priv = s->priv;
+
+	priv->requests = g_list_remove(priv->requests, r);
+	priv->in_flight[r->prio]--;
+	priv->running--;
+
+	if (priv->freeing) {
+		free(r);
+		return;
+	}
+
+	if (r->kind == SR_REQUEST_NOW_PLAYING) {
+		unsigned latency = sr_clock_monotonic() - r->queued;
+		priv->np_latency[priv->np_samples++ % NP_SAMPLES] = latency;
+	}
+
+	r->callback(session, message, s);
+	free(r);
+
+	dispatch(s);
+}
+
+static void
+radio_activity(struct sr_session_priv *priv,
+		uint64_t now)
+{
+	if (!last_activity || now - last_activity > RADIO_TAIL)
+		priv->stats.windows++;
+	last_activity = now;
+}
+
+static inline bool
+radio_up(void)
+{
+	return last_activity && sr_clock_monotonic() - last_activity <= RADIO_TAIL;
+}
+
+/* the track is over, telling the server now would be wrong */
+static inline bool
+np_stale(sr_track_t *t)
+{
+	unsigned age = t->length > 0 ? (unsigned) t->length : NP_MAX_AGE;
+	return sr_clock_now() >= t->timestamp + age;
+}
+
+static void
+start_request(sr_session_t *s,
+		struct request *r)
+{
+	struct sr_session_priv *priv = s->priv;
+	uint64_t now = sr_clock_monotonic();
+
+	radio_activity(priv, now);
+
+	r->start = now;
+	priv->in_flight[r->prio]++;
+	priv->running++;
+	priv->requests = g_list_prepend(priv->requests, r);
+
+	if (!priv->watchdog)
+		priv->watchdog = sr_timeout_add_seconds(WATCHDOG_PERIOD, watchdog, s);
+
+	soup_session_queue_message(priv->soup, r->message, request_done, r);
+}
+
+/* the most urgent class with room, unless another one waited too long */
+static struct request *
+next_request(struct sr_session_priv *priv)
+{
+	uint64_t now = sr_clock_monotonic();
+	int best = -1, starved = -1;
+
+	for (int i = 0; i < PRIO_LAST; i++) {
+		struct request *r = g_queue_peek_head(&priv->pending[i]);
+
+		if (!r || priv->in_flight[i] >= class_limits[i])
+			continue;
+		if (i != PRIO_NOW_PLAYING && priv->running >= MAX_IN_FLIGHT - 1)
+			continue;
+		if (best < 0)
+			best = i;
+		if (starved < 0 && now - r->queued >= STARVATION_LIMIT)
+			starved = i;
+	}
+
+	if (starved >= 0)
+		best = starved;
+	if (best < 0)
+		return NULL;
+	return g_queue_pop_head(&priv->pending[best]);
+}
+
+static void
+dispatch(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	struct request *r;
+
+	while (priv->running < MAX_IN_FLIGHT && (r = next_request(priv)))
+		start_request(s, r);
+}
+
+static void
+queue_message(sr_session_t *s,
+		SoupMessage *message,
+		int kind,
+		SoupSessionCallback callback)
+{
+	struct sr_session_priv *priv = s->priv;
+	struct request *r;
+
+	r = calloc(1, sizeof(*r));
+	r->s = s;
+	r->message = message;
+	r->callback = callback;
+	r->kind = kind;
+	r->prio = request_prio(kind);
+	r->queued = sr_clock_monotonic();
+	g_queue_push_tail(&priv->pending[r->prio], r);
+
+	dispatch(s);
+}
+
+static int
+compare_uint(const void *a,
+		const void *b)
+{
+	unsigned ua = *(const unsigned *) a, ub = *(const unsigned *) b;
+	return ua < ub ? -1 : ua > ub;
+}
+
+/* over the last NP_SAMPLES */
+static void
+np_percentiles(struct sr_session_priv *priv,
+		struct sr_session_stats *stats)
+{
+	unsigned sorted[NP_SAMPLES];
+	unsigned n = MIN(priv->np_samples, NP_SAMPLES);
+
+	if (!n)
+		return;
+
+	memcpy(sorted, priv->np_latency, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), compare_uint);
+	stats->np_latency_p50 = sorted[n * 50 / 100];
+	stats->np_latency_p90 = sorted[n * 90 / 100];
+	stats->np_latency_max = sorted[n - 1];
+}
 
 sr_session_t *
 sr_session_new(const char *url,
@@ -55,15 +428,20 @@ sr_session_new(const char *url,
 	struct sr_session_priv *priv;
 	s = calloc(1, sizeof(*s));
 	s->priv = priv = calloc(1, sizeof(*priv));
+	priv->id = g_atomic_int_exchange_and_add(&session_count, 1) + 1;
 	priv->queue = g_queue_new();
 	priv->queue_mutex = g_mutex_new();
+	priv->returned = g_hash_table_new_full(fp_hash, fp_equal, g_free, NULL);
 	priv->url = g_strdup(url);
 	priv->client_id = g_strdup(client_id);
 	priv->client_ver = g_strdup(client_ver);
 	priv->soup = soup_session_async_new();
 	priv->handshake_delay = 1;
+	priv->batch_limit = priv->stats.batch_limit = MAX_BATCH;
+	memcpy(priv->timeouts, default_timeouts, sizeof(priv->timeouts));
 	priv->love_queue = g_queue_new();
 	priv->love_queue_mutex = g_mutex_new();
+	strings_changed(priv);
 	return s;
 }
 
@@ -77,6 +455,13 @@ sr_session_free(sr_session_t *s)
 
 	priv = s->priv;
 
+	/* the callbacks of whatever is in flight run here, before anything is gone */
+	priv->freeing = true;
+	soup_session_abort(priv->soup);
+	g_object_unref(priv->soup);
+	if (priv->watchdog)
+		sr_timeout_remove(priv->watchdog);
+
 	while (!g_queue_is_empty(priv->love_queue)) {
 		sr_track_t *t;
 		t = g_queue_pop_head(priv->love_queue);
@@ -91,10 +476,19 @@ sr_session_free(sr_session_t *s)
 	g_free(priv->session_key);
 
 	if (priv->np_timer)
-		g_source_remove(priv->np_timer);
+		sr_timeout_remove(priv->np_timer);
+	if (priv->retry_timer)
+		sr_timeout_remove(priv->retry_timer);
+
+	/* never sent */
+	for (int i = 0; i < PRIO_LAST; i++) {
+		struct request *r;
+		while ((r = g_queue_pop_head(&priv->pending[i]))) {
+			g_object_unref(r->message);
+			free(r);
+		}
+	}
 
-	soup_session_abort(priv->soup);
-	g_object_unref(priv->soup);
 	while (!g_queue_is_empty(priv->queue)) {
 		sr_track_t *t;
 		t = g_queue_pop_head(priv->queue);
@@ -102,6 +496,8 @@ sr_session_free(sr_session_t *s)
 	}
 	g_queue_free(priv->queue);
 	g_mutex_free(priv->queue_mutex);
+	g_hash_table_destroy(priv->returned);
+	sr_track_free(priv->last_track);
 	g_free(priv->url);
 	g_free(priv->client_id);
 	g_free(priv->client_ver);
@@ -110,19 +506,40 @@ sr_session_free(sr_session_t *s)
 	g_free(priv->session_id);
 	g_free(priv->now_playing_url);
 	g_free(priv->submit_url);
+	g_free(priv->archive);
+	g_free(priv->spill);
+	g_free(priv->quarantine);
+	g_free(priv->handshake_file);
 	free(s->priv);
 	free(s);
 }
 
+void
+sr_session_set_url(sr_session_t *s,
+		const char *url)
+{
+	struct sr_session_priv *priv = s->priv;
+
+	if (g_strcmp0(priv->url, url) == 0)
+		return;
+
+	g_free(priv->url);
+	priv->url = g_strdup(url);
+
+	/* the old session is meaningless now */
+	g_free(priv->session_id);
+	priv->session_id = NULL;
+	strings_changed(priv);
+}
+
 void sr_session_set_cred(sr_session_t *s,
 		char *user,
 		char *password)
 {
-	struct sr_session_priv *priv = s->priv;
-	g_free(priv->user);
-	g_free(priv->hash_pwd);
-	priv->user = g_strdup(user);
-	priv->hash_pwd = g_compute_checksum_for_string(G_CHECKSUM_MD5, password, -1);
+	char *hash_pwd;
+	hash_pwd = g_compute_checksum_for_string(G_CHECKSUM_MD5, password, -1);
+	sr_session_set_cred_hash(s, user, hash_pwd);
+	g_free(hash_pwd);
 }
 
 void sr_session_set_cred_hash(sr_session_t *s,
@@ -130,10 +547,20 @@ void sr_session_set_cred_hash(sr_session_t *s,
 		char *hash_pwd)
 {
 	struct sr_session_priv *priv = s->priv;
+
+	if (g_strcmp0(priv->user, user) == 0 &&
+			g_strcmp0(priv->hash_pwd, hash_pwd) == 0)
+		return;
+
 	g_free(priv->user);
 	g_free(priv->hash_pwd);
 	priv->user = g_strdup(user);
 	priv->hash_pwd = g_strdup(hash_pwd);
+
+	/* the old session belongs to the old credentials */
+	g_free(priv->session_id);
+	priv->session_id = NULL;
+	strings_changed(priv);
 }
 
 sr_track_t *
@@ -156,10 +583,20 @@ sr_track_free(sr_track_t *t)
 	free(t);
 }
 
+/* every sr_track_dup(), in any session */
+static int track_copies;
+
+unsigned
+sr_track_copies(void)
+{
+	return g_atomic_int_get(&track_copies);
+}
+
 sr_track_t *
 sr_track_dup(sr_track_t *in)
 {
 	sr_track_t *t;
+	g_atomic_int_inc(&track_copies);
 	t = sr_track_new();
 	t->artist = g_strdup(in->artist);
 	t->title = g_strdup(in->title);
@@ -173,6 +610,66 @@ sr_track_dup(sr_track_t *in)
 	return t;
 }
 
+static inline size_t
+str_size(const char *str)
+{
+	return str ? strlen(str) + 1 : 0;
+}
+
+/* including the queue node; allocator overhead isn't, so it's an estimate */
+static size_t
+track_size(sr_track_t *t)
+{
+	return sizeof(*t) + sizeof(GList) +
+		str_size(t->artist) + str_size(t->title) +
+		str_size(t->album) + str_size(t->mbid);
+}
+
+/*
+ * The queue only has tracks older than any spilled one, so whatever is
+ * newer has to go to the spill as well.
+ */
+static bool
+spill_track(struct sr_session_priv *priv,
+		FILE **f,
+		sr_track_t *t)
+{
+	if (!*f)
+		*f = fopen(priv->spill, "a");
+	if (!*f)
+		return false;
+	sr_track_write(t, *f);
+	if (!priv->spill_oldest || t->timestamp < priv->spill_oldest)
+		priv->spill_oldest = t->timestamp;
+	return true;
+}
+
+/* must be called with the queue locked; takes the track if it spills it */
+static bool
+spill_newer(struct sr_session_priv *priv,
+		FILE **f,
+		sr_track_t *t)
+{
+	if (!priv->spill_oldest || t->timestamp < priv->spill_oldest)
+		return false;
+	if (!spill_track(priv, f, t))
+		return false;
+	priv->stats.spilled++;
+	sr_track_free(t);
+	return true;
+}
+
+static void enforce_budget(sr_session_t *s);
+
+/* did the track play long enough? */
+int
+sr_track_played(sr_track_t *t,
+		unsigned end)
+{
+	int playtime = end - t->timestamp;
+	return (playtime >= 240 || playtime >= t->length / 2) && (t->length > 30 || !t->length);
+}
+
 static inline void
 check_last(sr_session_t *s,
 		int timestamp)
@@ -185,20 +682,34 @@ check_last(sr_session_t *s,
 	if (!c)
 		return;
 
-	if (c->rating == 'L' && priv->session_key) {
+	if (c->rating == 'L' && priv->api_key) {
+		sr_track_t *t = sr_track_dup(c);
 		g_mutex_lock(priv->love_queue_mutex);
-		g_queue_push_tail(priv->love_queue, sr_track_dup(c));
+		g_queue_push_tail(priv->love_queue, t);
+		priv->love_bytes += track_size(t);
 		g_mutex_unlock(priv->love_queue_mutex);
-		if (!priv->api_problems)
-			ws_love(s, true);
+		if (!priv->api_problems && !priv->held)
+			ws_love(s);
 	}
 
 	playtime = timestamp - c->timestamp;
-	/* did the last track played long enough? */
-	if ((playtime >= 240 || playtime >= c->length / 2) && (c->length > 30 || !c->length))
-		g_queue_push_tail(priv->queue, c);
-	else
+	if (sr_track_played(c, timestamp)) {
+		FILE *spill = NULL;
+
+		sr_trace(SR_TRACE_CHECK_LAST, priv->id, playtime, 1);
+		if (!spill_newer(priv, &spill, c)) {
+			g_queue_push_tail(priv->queue, c);
+			priv->queue_bytes += track_size(c);
+		}
+		else
+			fclose(spill);
+		priv->last_track = NULL;
+		enforce_budget(s);
+	}
+	else {
+		sr_trace(SR_TRACE_CHECK_LAST, priv->id, playtime, 0);
 		sr_track_free(c);
+	}
 	priv->last_track = NULL;
 }
 
@@ -207,7 +718,7 @@ sr_session_pause(sr_session_t *s)
 {
 	struct sr_session_priv *priv = s->priv;
 	g_mutex_lock(priv->queue_mutex);
-	check_last(s, time(NULL));
+	check_last(s, sr_clock_now());
 	g_mutex_unlock(priv->queue_mutex);
 }
 
@@ -217,10 +728,38 @@ do_now_playing(void *data)
 	sr_session_t *s = data;
 	struct sr_session_priv *priv = s->priv;
 	priv->np_timer = 0;
+	/* held, but the radio is still up from something else */
+	if ((priv->held && !radio_up()) || !priv->session_id) {
+		/* sent after the flush, or the handshake */
+		priv->np_pending = true;
+		request_handshake(s);
+		return FALSE;
+	}
 	now_playing(s, priv->last_track);
 	return FALSE;
 }
 
+void
+sr_session_now_playing(sr_session_t *s,
+		sr_track_t *t)
+{
+	struct sr_session_priv *priv = s->priv;
+
+	if (priv->np_timer) {
+		sr_timeout_remove(priv->np_timer);
+		priv->np_timer = 0;
+	}
+
+	priv->np_pending = false;
+	if (t)
+		priv->np_timer = sr_timeout_add_seconds(3, do_now_playing, s);
+
+	g_mutex_lock(priv->queue_mutex);
+	sr_track_free(priv->last_track);
+	priv->last_track = t;
+	g_mutex_unlock(priv->queue_mutex);
+}
+
 void
 sr_session_add_track(sr_session_t *s,
 		sr_track_t *t)
@@ -228,9 +767,10 @@ sr_session_add_track(sr_session_t *s,
 	struct sr_session_priv *priv = s->priv;
 
 	if (priv->np_timer)
-		g_source_remove(priv->np_timer);
+		sr_timeout_remove(priv->np_timer);
 
-	priv->np_timer = g_timeout_add_seconds(3, do_now_playing, s);
+	priv->np_pending = false;
+	priv->np_timer = sr_timeout_add_seconds(3, do_now_playing, s);
 
 	g_mutex_lock(priv->queue_mutex);
 	check_last(s, t->timestamp);
@@ -282,69 +822,45 @@ track_is_valid(sr_track_t *t)
 	return !!t->artist;
 }
 
-int
-sr_session_load_list(sr_session_t *s,
-		const char *file)
+sr_track_t *
+sr_track_read(FILE *f)
 {
-	struct sr_session_priv *priv = s->priv;
-	FILE *f;
-	int c;
-	char k, *p, v[255];
-	int stage = 1;
-	sr_track_t *t;
-
-	f = fopen(file, "r");
-	if (!f)
-		return 1;
-
-	/* just to avoid warnings */
-	k = 0; p = NULL;
-
-	g_mutex_lock(priv->queue_mutex);
-	t = sr_track_new();
-	while (true) {
-		c = getc(f);
-		if (stage == 1) {
-			if (c == '\n') {
-				g_queue_push_tail(priv->queue, t);
-				t = sr_track_new();
-				continue;
-			}
-			if (c == EOF) {
-				if (track_is_valid(t))
-					g_queue_push_tail(priv->queue, t);
-				break;
-			}
-			k = c;
-			p = v;
-			fseek(f, 2, SEEK_CUR);
-			stage++;
+	sr_track_t *t = NULL;
+	char line[0x200];
+
+	while (fgets(line, sizeof(line), f)) {
+		size_t len = strlen(line);
+
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		else if (!feof(f)) {
+			/* too long; truncate */
+			int c;
+			while ((c = getc(f)) != EOF && c != '\n');
 		}
-		else if (stage == 2) {
-			if (c == EOF)
+
+		if (len == 0) {
+			/* end of record */
+			if (t)
 				break;
-			*p = c;
-			if (c == '\n') {
-				*p = '\0';
-				got_field(t, k, v);
-				stage = 1;
-			}
-			p++;
+			continue;
 		}
+
+		if (len < 3)
+			continue;
+
+		if (!t)
+			t = sr_track_new();
+		got_field(t, line[0], line + 3);
 	}
-	g_mutex_unlock(priv->queue_mutex);
 
-	fclose(f);
-	return 0;
+	return t;
 }
 
-static void
-store_track(void *data,
-		void *user_data)
+void
+sr_track_write(sr_track_t *t,
+		FILE *f)
 {
-	sr_track_t *t = data;
-	FILE *f = user_data;
-
 	fprintf(f, "a: %s\n", t->artist);
 	fprintf(f, "t: %s\n", t->title);
 	fprintf(f, "i: %u\n", t->timestamp);
@@ -362,54 +878,942 @@ store_track(void *data,
 	fputc('\n', f);
 }
 
-int
-sr_session_store_list(sr_session_t *s,
-		const char *file)
+static inline bool
+track_expired(struct sr_session_priv *priv,
+		sr_track_t *t,
+		unsigned now)
+{
+	return priv->max_age && t->timestamp + priv->max_age < now;
+}
+
+/* must be called with the queue locked, and nothing in flight */
+static void
+prune_queue(sr_session_t *s)
 {
-	FILE *f;
 	struct sr_session_priv *priv = s->priv;
+	unsigned now = sr_clock_now();
+	FILE *archive = NULL;
+	GList *c, *next;
 
-	f = fopen(file, "w");
-	g_mutex_lock(priv->queue_mutex);
-	g_queue_foreach(priv->queue, store_track, f);
-	g_mutex_unlock(priv->queue_mutex);
-	fclose(f);
-	return 0;
+	if (!priv->max_age && !priv->max_count)
+		return;
+
+	for (c = priv->queue->head; c; c = next) {
+		sr_track_t *t = c->data;
+		next = c->next;
+
+		/* oldest entries are at the head */
+		if (!track_expired(priv, t, now) &&
+				(!priv->max_count || priv->queue->length <= priv->max_count))
+			continue;
+
+		if (priv->archive && !archive)
+			archive = fopen(priv->archive, "a");
+		if (archive)
+			sr_track_write(t, archive);
+
+		priv->queue_bytes -= track_size(t);
+		g_queue_delete_link(priv->queue, c);
+		sr_track_free(t);
+		priv->stats.expired++;
+	}
+
+	if (archive)
+		fclose(archive);
 }
 
 void
-sr_session_test(sr_session_t *s)
+sr_session_set_retention(sr_session_t *s,
+		unsigned max_age,
+		unsigned max_count,
+		const char *archive)
 {
 	struct sr_session_priv *priv = s->priv;
+
 	g_mutex_lock(priv->queue_mutex);
-	g_queue_foreach(priv->queue, store_track, stdout);
+	priv->max_age = max_age;
+	priv->max_count = max_count;
+	g_free(priv->archive);
+	priv->archive = g_strdup(archive);
+	priv->strings_bytes = strings_size(priv);
+	if (!priv->submit_count)
+		prune_queue(s);
 	g_mutex_unlock(priv->queue_mutex);
 }
 
-static void
-parse_handshake(sr_session_t *s,
-		const char *data)
+void
+sr_session_set_quarantine(sr_session_t *s,
+		const char *file)
 {
 	struct sr_session_priv *priv = s->priv;
-	char **response;
-
-	response = g_strsplit(data, "\n", 5);
+
+	g_mutex_lock(priv->queue_mutex);
+	g_free(priv->quarantine);
+	priv->quarantine = g_strdup(file);
+	g_mutex_unlock(priv->queue_mutex);
+}
+
+void
+sr_session_get_stats(sr_session_t *s,
+		struct sr_session_stats *stats)
+{
+	struct sr_session_priv *priv = s->priv;
+
+	g_mutex_lock(priv->queue_mutex);
+	*stats = priv->stats;
+	g_mutex_unlock(priv->queue_mutex);
+	np_percentiles(priv, stats);
+}
+
+static int
+compare_timestamp(const void *a,
+		const void *b,
+		void *data)
+{
+	const sr_track_t *ta = a, *tb = b;
+	return ta->timestamp < tb->timestamp ? -1 : ta->timestamp > tb->timestamp;
+}
+
+/*
+ * Must be called with the queue locked. Takes the tracks and puts them in
+ * order with what's queued, but after what's in flight; most are older.
+ */
+static void
+merge_tracks(sr_session_t *s,
+		GQueue *tracks)
+{
+	struct sr_session_priv *priv = s->priv;
+	FILE *spill = NULL;
+	sr_track_t *t;
+	GList *c;
+
+	g_queue_sort(tracks, compare_timestamp, NULL);
+	c = g_queue_peek_nth_link(priv->queue, in_flight_tracks(priv));
+	while ((t = g_queue_pop_head(tracks))) {
+		if (spill_newer(priv, &spill, t))
+			continue;
+		while (c && ((sr_track_t *) c->data)->timestamp <= t->timestamp)
+			c = c->next;
+		if (c)
+			g_queue_insert_before(priv->queue, c, t);
+		else
+			g_queue_push_tail(priv->queue, t);
+		priv->queue_bytes += track_size(t);
+	}
+	if (spill)
+		fclose(spill);
+}
+
+int
+sr_session_load_list(sr_session_t *s,
+		const char *file)
+{
+	struct sr_session_priv *priv = s->priv;
+	FILE *f;
+	sr_track_t *t;
+	GQueue *loaded;
+	GList *c, *next;
+
+	f = fopen(file, "r");
+	if (!f)
+		return 1;
+
+	/* parse without the lock, this might be running in a thread */
+	loaded = g_queue_new();
+	while ((t = sr_track_read(f))) {
+		if (track_is_valid(t))
+			g_queue_push_tail(loaded, t);
+		else
+			sr_track_free(t);
+	}
+	fclose(f);
+
+	g_mutex_lock(priv->queue_mutex);
+	for (c = loaded->head; c; c = next) {
+		t = c->data;
+		next = c->next;
+		/* acknowledged, but the list wasn't stored after that */
+		if (priv->ledger && sr_ledger_contains(priv->ledger, t)) {
+			g_queue_delete_link(loaded, c);
+			sr_track_free(t);
+			priv->stats.already_acked++;
+		}
+	}
+	merge_tracks(s, loaded);
+	if (!priv->submit_count)
+		prune_queue(s);
+	enforce_budget(s);
+	g_mutex_unlock(priv->queue_mutex);
+
+	g_queue_free(loaded);
+	return 0;
+}
+
+int
+sr_session_queue_tracks(sr_session_t *s,
+		sr_track_t **tracks,
+		unsigned count)
+{
+	struct sr_session_priv *priv = s->priv;
+	unsigned now = sr_clock_now();
+	GQueue valid = G_QUEUE_INIT;
+	int queued;
+
+	for (unsigned i = 0; i < count; i++) {
+		sr_track_t *t = tracks[i];
+		/* the server wants when they started playing */
+		if (!track_is_valid(t) || !t->title ||
+				!t->timestamp || t->timestamp > now) {
+			sr_track_free(t);
+			continue;
+		}
+		g_queue_push_tail(&valid, t);
+	}
+	queued = valid.length;
+
+	/* third parties usually submit older tracks */
+	g_mutex_lock(priv->queue_mutex);
+	merge_tracks(s, &valid);
+	if (!priv->submit_count)
+		prune_queue(s);
+	enforce_budget(s);
+	g_mutex_unlock(priv->queue_mutex);
+
+	return queued;
+}
+
+/* tracks are appended in chunks of this size, to keep the lock short */
+#define IMPORT_CHUNK 256
+/* log lines remembered to catch repeated ones */
+#define IMPORT_SEEN 4096
+
+struct import {
+	sr_session_t *s;
+	struct sr_import_stats *stats;
+	GHashTable *seen; /* fingerprints, pointing into queued and the ring */
+	uint64_t *queued; /* the whole queue, never forgotten */
+	uint64_t *ring; /* the last IMPORT_SEEN lines */
+	unsigned ring_pos;
+	bool local; /* timestamps in local time */
+	unsigned now;
+	long zone_hour; /* local hour of the cached offset */
+	int zone_offset;
+	sr_track_t *chunk[IMPORT_CHUNK];
+	unsigned count;
+};
+
+/* the offset only changes on the hour, at most */
+static unsigned
+import_time(struct import *im,
+		unsigned t)
+{
+	struct tm tm;
+	time_t l = t;
+
+	if (!im->local)
+		return t;
+
+	if ((long) (t / 3600) != im->zone_hour) {
+		gmtime_r(&l, &tm);
+		tm.tm_isdst = -1;
+		im->zone_offset = t - mktime(&tm);
+		im->zone_hour = t / 3600;
+	}
+	return t - im->zone_offset;
+}
+
+static void
+import_flush(struct import *im)
+{
+	struct sr_session_priv *priv = im->s->priv;
+	GQueue chunk = G_QUEUE_INIT;
+
+	if (!im->count)
+		return;
+
+	for (unsigned i = 0; i < im->count; i++)
+		g_queue_push_tail(&chunk, im->chunk[i]);
+
+	/* logs are usually older than what's queued */
+	g_mutex_lock(priv->queue_mutex);
+	merge_tracks(im->s, &chunk);
+	if (!priv->submit_count)
+		prune_queue(im->s);
+	enforce_budget(im->s);
+	g_mutex_unlock(priv->queue_mutex);
+
+	im->stats->queued += im->count;
+	im->count = 0;
+}
+
+static inline char *
+next_field(char **p)
+{
+	char *field = *p, *end;
+
+	if (!field)
+		return NULL;
+	end = strchr(field, '\t');
+	if (end)
+		*end++ = '\0';
+	*p = end;
+	return field;
+}
+
+/*
+ * Only the recent lines are remembered; a log repeats itself in chunks,
+ * and the ledger catches what was submitted long ago. What matches the
+ * queue never enters the ring, so evicting can't forget the queue.
+ */
+static bool
+import_seen(struct import *im,
+		sr_track_t *t)
+{
+	uint64_t fp = sr_ledger_fingerprint(t);
+	uint64_t *slot;
+
+	if (g_hash_table_lookup(im->seen, &fp))
+		return true;
+
+	slot = &im->ring[im->ring_pos++ % IMPORT_SEEN];
+	if (im->ring_pos > IMPORT_SEEN)
+		g_hash_table_remove(im->seen, slot);
+	*slot = fp;
+	g_hash_table_insert(im->seen, slot, slot);
+	return false;
+}
+
+/* artist album title tracknum length rating timestamp [mbid] */
+static void
+import_line(struct import *im,
+		char *line)
+{
+	char *p = line;
+	char *artist, *album, *title, *num, *length, *rating, *stamp, *mbid;
+	struct sr_session_priv *priv = im->s->priv;
+	sr_track_t *t;
+	unsigned timestamp;
+
+	artist = next_field(&p);
+	album = next_field(&p);
+	title = next_field(&p);
+	num = next_field(&p);
+	length = next_field(&p);
+	rating = next_field(&p);
+	stamp = next_field(&p);
+	mbid = next_field(&p);
+
+	if (!stamp || !*artist || !*title) {
+		im->stats->invalid++;
+		return;
+	}
+
+	/* only 'L'istened ones count */
+	if (rating[0] == 'S') {
+		im->stats->skipped++;
+		return;
+	}
+
+	timestamp = import_time(im, strtoul(stamp, NULL, 10));
+	if (!timestamp || timestamp > im->now) {
+		im->stats->invalid++;
+		return;
+	}
+
+	t = sr_track_new();
+	t->artist = g_strdup(artist);
+	t->title = g_strdup(title);
+	t->timestamp = timestamp;
+	t->source = 'P';
+	t->length = atoi(length);
+	if (*album)
+		t->album = g_strdup(album);
+	t->position = atoi(num);
+	if (mbid && *mbid)
+		t->mbid = g_strdup(mbid);
+
+	if (t->length && t->length <= 30) {
+		sr_track_free(t);
+		im->stats->invalid++;
+		return;
+	}
+
+	if (import_seen(im, t) ||
+			(priv->ledger && sr_ledger_contains(priv->ledger, t))) {
+		sr_track_free(t);
+		im->stats->duplicates++;
+		return;
+	}
+
+	im->chunk[im->count++] = t;
+	if (im->count == IMPORT_CHUNK)
+		import_flush(im);
+}
+
+int
+sr_session_import_log(sr_session_t *s,
+		const char *file,
+		struct sr_import_stats *stats)
+{
+	struct sr_session_priv *priv = s->priv;
+	struct import im = { .s = s, .stats = stats, .local = true, .zone_hour = -1 };
+	char line[0x400];
+	unsigned n = 0;
+	FILE *f;
+
+	memset(stats, 0, sizeof(*stats));
+
+	f = fopen(file, "r");
+	if (!f)
+		return 1;
+
+	/* the other versions have different fields */
+	if (!fgets(line, sizeof(line), f) ||
+			strncmp(line, "#AUDIOSCROBBLER/1.1", 19) != 0 ||
+			!strchr("\r\n", line[19])) {
+		fclose(f);
+		return 2;
+	}
+
+	im.now = sr_clock_now();
+	im.seen = g_hash_table_new(fp_hash, fp_equal);
+	im.ring = g_new(uint64_t, IMPORT_SEEN);
+
+	/* what is already queued counts as seen, all of it */
+	g_mutex_lock(priv->queue_mutex);
+	im.queued = g_new(uint64_t, priv->queue->length);
+	for (GList *c = priv->queue->head; c; c = c->next) {
+		uint64_t *fp = &im.queued[n++];
+		*fp = sr_ledger_fingerprint(c->data);
+		g_hash_table_insert(im.seen, fp, fp);
+	}
+	g_mutex_unlock(priv->queue_mutex);
+
+	while (fgets(line, sizeof(line), f)) {
+		size_t len = strlen(line);
+
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		else if (!feof(f)) {
+			/* too long to be real */
+			int c;
+			while ((c = getc(f)) != EOF && c != '\n');
+			stats->lines++;
+			stats->invalid++;
+			continue;
+		}
+		if (len && line[len - 1] == '\r')
+			line[--len] = '\0';
+
+		if (line[0] == '#') {
+			if (strncmp(line, "#TZ/", 4) == 0)
+				im.local = strcmp(line + 4, "UTC") != 0;
+			continue;
+		}
+		if (len == 0)
+			continue;
+
+		stats->lines++;
+		import_line(&im, line);
+	}
+	fclose(f);
+
+	import_flush(&im);
+	g_hash_table_destroy(im.seen);
+	g_free(im.queued);
+	g_free(im.ring);
+	return 0;
+}
+
+static void
+store_track(void *data,
+		void *user_data)
+{
+	sr_track_write(data, user_data);
+}
+
+int
+sr_session_store_list(sr_session_t *s,
+		const char *file)
+{
+	FILE *f;
+	struct sr_session_priv *priv = s->priv;
+
+	f = fopen(file, "w");
+	g_mutex_lock(priv->queue_mutex);
+	g_queue_foreach(priv->queue, store_track, f);
+	g_mutex_unlock(priv->queue_mutex);
+	fclose(f);
+	return 0;
+}
+
+void
+sr_session_test(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	g_mutex_lock(priv->queue_mutex);
+	g_queue_foreach(priv->queue, store_track, stdout);
+	g_mutex_unlock(priv->queue_mutex);
+}
+
+struct export {
+	FILE *f;
+	int format;
+	const char *kind;
+	unsigned count;
+};
+
+static void
+write_json_string(FILE *f,
+		const char *str)
+{
+	if (!str) {
+		fputs("null", f);
+		return;
+	}
+
+	putc('"', f);
+	for (; *str; str++) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			putc(c, f);
+	}
+	putc('"', f);
+}
+
+static void
+write_csv_string(FILE *f,
+		const char *str)
+{
+	if (!str)
+		return;
+
+	if (!strpbrk(str, ",\"\r\n")) {
+		fputs(str, f);
+		return;
+	}
+
+	putc('"', f);
+	for (; *str; str++) {
+		if (*str == '"')
+			putc('"', f);
+		putc(*str, f);
+	}
+	putc('"', f);
+}
+
+static void
+export_track(sr_track_t *t,
+		void *user_data)
+{
+	struct export *e = user_data;
+	FILE *f = e->f;
+	char source[2] = { t->source, 0 }, rating[2] = { t->rating, 0 };
+
+	if (e->format == SR_EXPORT_CSV) {
+		fprintf(f, "%s,", e->kind);
+		write_csv_string(f, t->artist);
+		putc(',', f);
+		write_csv_string(f, t->title);
+		putc(',', f);
+		write_csv_string(f, t->album);
+		fprintf(f, ",%u,%i,%s,%s,%i,", t->timestamp, t->length,
+				source, rating, t->position);
+		write_csv_string(f, t->mbid);
+		putc('\n', f);
+	}
+	else {
+		fprintf(f, "{\"kind\":\"%s\",\"artist\":", e->kind);
+		write_json_string(f, t->artist);
+		fputs(",\"title\":", f);
+		write_json_string(f, t->title);
+		fputs(",\"album\":", f);
+		write_json_string(f, t->album);
+		fprintf(f, ",\"timestamp\":%u,\"length\":%i,\"source\":",
+				t->timestamp, t->length);
+		write_json_string(f, t->source ? source : NULL);
+		fputs(",\"rating\":", f);
+		write_json_string(f, t->rating ? rating : NULL);
+		fprintf(f, ",\"position\":%i,\"mbid\":", t->position);
+		write_json_string(f, t->mbid);
+		fputs("}\n", f);
+	}
+	e->count++;
+}
+
+/*
+ * Copies are cheap compared to formatting, so only the copy happens under
+ * the lock. It costs as much as the queue itself, which the memory budget
+ * already bounds.
+ */
+static void
+export_queue(struct export *e,
+		GQueue *queue,
+		GMutex *mutex)
+{
+	sr_track_t **snapshot;
+	unsigned count = 0;
+
+	g_mutex_lock(mutex);
+	snapshot = g_new(sr_track_t *, queue->length);
+	for (GList *c = queue->head; c; c = c->next)
+		snapshot[count++] = sr_track_dup(c->data);
+	g_mutex_unlock(mutex);
+
+	for (unsigned i = 0; i < count; i++) {
+		export_track(snapshot[i], e);
+		sr_track_free(snapshot[i]);
+	}
+	g_free(snapshot);
+}
+
+int
+sr_session_export(sr_session_t *s,
+		FILE *f,
+		int format,
+		int what)
+{
+	struct sr_session_priv *priv = s->priv;
+	struct export e = { .f = f, .format = format };
+
+	if (format == SR_EXPORT_CSV)
+		fputs("kind,artist,title,album,timestamp,length,source,rating,position,mbid\n", f);
+
+	if (what & SR_EXPORT_QUEUE) {
+		e.kind = "queue";
+		export_queue(&e, priv->queue, priv->queue_mutex);
+	}
+	if (what & SR_EXPORT_LOVE) {
+		e.kind = "love";
+		export_queue(&e, priv->love_queue, priv->love_queue_mutex);
+	}
+	if ((what & SR_EXPORT_HISTORY) && priv->history) {
+		e.kind = "history";
+		sr_history_foreach(priv->history, 0, 0, export_track, &e);
+	}
+
+	return e.count;
+}
+
+static void
+parse_handshake(sr_session_t *s,
+		const char *data)
+{
+	struct sr_session_priv *priv = s->priv;
+	char **response;
+
+	response = g_strsplit(data, "\n", 5);
+
+	g_free(priv->session_id);
+	g_free(priv->now_playing_url);
+	g_free(priv->submit_url);
+
+	priv->session_id = g_strdup(response[1]);
+	priv->now_playing_url = g_strdup(response[2]);
+	priv->submit_url = g_strdup(response[3]);
+	priv->handshake_time = sr_clock_now();
+	strings_changed(priv);
+
+	g_strfreev(response);
+}
+
+/* not the hash itself, that's what the server takes */
+static char *
+password_key(struct sr_session_priv *priv)
+{
+	return g_compute_checksum_for_string(G_CHECKSUM_MD5,
+			priv->hash_pwd ? priv->hash_pwd : "", -1);
+}
+
+static void
+store_handshake(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	FILE *f;
+	char *key;
+	int fd;
+
+	if (!priv->handshake_file)
+		return;
+
+	/* the session id is as good as the password for a while */
+	fd = open(priv->handshake_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return;
+	/* written by older versions */
+	fchmod(fd, 0600);
+	f = fdopen(fd, "w");
+	if (!f) {
+		close(fd);
+		return;
+	}
+	/* only valid for the same user, password and server */
+	key = password_key(priv);
+	fprintf(f, "u: %s\n", priv->user);
+	fprintf(f, "k: %s\n", key);
+	fprintf(f, "h: %s\n", priv->url);
+	fprintf(f, "s: %s\n", priv->session_id);
+	fprintf(f, "n: %s\n", priv->now_playing_url);
+	fprintf(f, "p: %s\n", priv->submit_url);
+	fprintf(f, "i: %u\n", priv->handshake_time);
+	fclose(f);
+	g_free(key);
+}
+
+static bool
+load_handshake(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	char *user = NULL, *url = NULL, *key = NULL, *our_key;
+	char *session_id = NULL, *np_url = NULL, *submit_url = NULL;
+	unsigned timestamp = 0;
+	char line[0x200];
+	bool ok = false;
+	FILE *f;
+
+	f = fopen(priv->handshake_file, "r");
+	if (!f)
+		return false;
+
+	while (fgets(line, sizeof(line), f)) {
+		char **field = NULL;
+
+		g_strchomp(line);
+		if (strlen(line) < 3)
+			continue;
+
+		switch (line[0]) {
+		case 'u':
+			field = &user;
+			break;
+		case 'k':
+			field = &key;
+			break;
+		case 'h':
+			field = &url;
+			break;
+		case 's':
+			field = &session_id;
+			break;
+		case 'n':
+			field = &np_url;
+			break;
+		case 'p':
+			field = &submit_url;
+			break;
+		case 'i':
+			timestamp = atoi(line + 3);
+			break;
+		default:
+			break;
+		}
+		if (field) {
+			g_free(*field);
+			*field = g_strdup(line + 3);
+		}
+	}
+	fclose(f);
+
+	if (!session_id || !np_url || !submit_url)
+		goto leave;
+	if (g_strcmp0(user, priv->user) != 0 || g_strcmp0(url, priv->url) != 0)
+		goto leave;
+	our_key = password_key(priv);
+	if (g_strcmp0(key, our_key) != 0) {
+		g_free(our_key);
+		goto leave;
+	}
+	g_free(our_key);
+	if (timestamp + priv->handshake_validity < sr_clock_now())
+		goto leave;
 
 	g_free(priv->session_id);
 	g_free(priv->now_playing_url);
 	g_free(priv->submit_url);
+	priv->session_id = session_id;
+	priv->now_playing_url = np_url;
+	priv->submit_url = submit_url;
+	priv->handshake_time = timestamp;
+	strings_changed(priv);
+	session_id = np_url = submit_url = NULL;
+	priv->stats.resumed++;
+	ok = true;
+
+leave:
+	g_free(user);
+	g_free(url);
+	g_free(key);
+	g_free(session_id);
+	g_free(np_url);
+	g_free(submit_url);
+	return ok;
+}
+
+/*
+ * Remember handshakes in 'file', and resume from it, as long as they are not
+ * older than 'validity' seconds. A stale session is detected by the server
+ * (BADSESSION), and then a new handshake is done.
+ */
+void
+sr_session_set_handshake_cache(sr_session_t *s,
+		const char *file,
+		unsigned validity)
+{
+	struct sr_session_priv *priv = s->priv;
+
+	g_free(priv->handshake_file);
+	priv->handshake_file = g_strdup(file);
+	priv->handshake_validity = validity;
+
+	if (!priv->session_id && priv->handshake_file && priv->user)
+		load_handshake(s);
+}
+
+void
+sr_session_set_timeout(sr_session_t *s,
+		int kind,
+		int sec)
+{
+	struct sr_session_priv *priv = s->priv;
+	priv->timeouts[kind] = sec < 0 ? default_timeouts[kind] : (unsigned) sec;
+}
+
+/* the queues can be filled from other threads */
+static inline bool
+queue_empty(GQueue *queue,
+		GMutex *mutex)
+{
+	bool empty;
+
+	g_mutex_lock(mutex);
+	empty = g_queue_is_empty(queue);
+	g_mutex_unlock(mutex);
+	return empty;
+}
+
+static inline bool
+has_pending(struct sr_session_priv *priv)
+{
+	return !queue_empty(priv->queue, priv->queue_mutex) ||
+		!queue_empty(priv->love_queue, priv->love_queue_mutex) ||
+		priv->last_track;
+}
+
+#if !defined(HAVE_SOUP_PREFETCH) && !defined(HAVE_SOUP_PREPARE)
+static void
+resolved(SoupAddress *addr,
+		guint status,
+		void *user_data)
+{
+	g_object_unref(addr);
+}
+#endif
+
+/* 'hosts' are the ones already warm; the endpoints usually share them */
+static void
+warm_up(sr_session_t *s,
+		const char *url,
+		GPtrArray *hosts)
+{
+	struct sr_session_priv *priv = s->priv;
+	SoupURI *uri;
+
+	if (!url)
+		return;
+	uri = soup_uri_new(url);
+	if (!uri)
+		return;
+
+	for (unsigned i = 0; i < hosts->len; i++) {
+		if (g_strcmp0(g_ptr_array_index(hosts, i), uri->host) == 0) {
+			soup_uri_free(uri);
+			return;
+		}
+	}
+	g_ptr_array_add(hosts, g_strdup(uri->host));
+
+#if defined(HAVE_SOUP_PREFETCH)
+	soup_session_prefetch_dns(priv->soup, uri->host, NULL, NULL, NULL);
+#elif defined(HAVE_SOUP_PREPARE)
+	/* resolves, and opens a connection the next request can reuse */
+	soup_session_prepare_for_uri(priv->soup, uri);
+#else
+	/* at least the address ends up in the resolver's cache */
+	soup_address_resolve_async(soup_address_new(uri->host, uri->port),
+			NULL, NULL, resolved, NULL);
+#endif
+	priv->stats.warm_ups++;
+
+	soup_uri_free(uri);
+}
+
+void
+sr_session_reconnected(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	GPtrArray *hosts;
+
+	priv->reconnect_time = sr_clock_monotonic();
+
+	/* only when a burst is expected */
+	if (!priv->user || !has_pending(priv))
+		return;
+
+	radio_activity(priv, priv->reconnect_time);
+
+	hosts = g_ptr_array_new();
+	if (priv->session_id) {
+		warm_up(s, priv->submit_url, hosts);
+		warm_up(s, priv->now_playing_url, hosts);
+	}
+	else
+		warm_up(s, priv->url, hosts);
+	if (priv->api_key)
+		warm_up(s, priv->api_url, hosts);
+	g_ptr_array_foreach(hosts, (GFunc) g_free, NULL);
+	g_ptr_array_free(hosts, TRUE);
+}
+
+/* is there anything that needs the submission session? */
+static inline bool
+needs_session(struct sr_session_priv *priv)
+{
+	return !queue_empty(priv->queue, priv->queue_mutex) ||
+		(priv->np_pending && priv->last_track && !np_stale(priv->last_track));
+}
+
+/*
+ * Single-flight and lazy: a handshake in flight, or a pending retry, will
+ * serve everybody, and there's no point in one without anything to send.
+ */
+static void
+request_handshake(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
 
-	priv->session_id = g_strdup(response[1]);
-	priv->now_playing_url = g_strdup(response[2]);
-	priv->submit_url = g_strdup(response[3]);
+	/* the next flush will do it */
+	if (priv->held)
+		return;
 
-	g_strfreev(response);
+	if (priv->handshaking || priv->retry_timer || !needs_session(priv)) {
+		priv->stats.handshakes_avoided++;
+		return;
+	}
+	sr_session_handshake(s);
 }
 
 static gboolean
 try_handshake(void *data)
 {
-	sr_session_handshake(data);
+	sr_session_t *s = data;
+	struct sr_session_priv *priv = s->priv;
+
+	priv->retry_timer = 0;
+	request_handshake(s);
 	return false;
 }
 
@@ -418,7 +1822,9 @@ handshake_failure(sr_session_t *s)
 {
 	struct sr_session_priv *priv = s->priv;
 
-	g_timeout_add_seconds(priv->handshake_delay * 60,
+	if (priv->retry_timer)
+		return;
+	priv->retry_timer = sr_timeout_add_seconds(priv->handshake_delay * 60,
 			try_handshake, s);
 
 	if (priv->handshake_delay < 120)
@@ -442,20 +1848,27 @@ handshake_cb(SoupSession *session,
 	struct sr_session_priv *priv = s->priv;
 	const char *data, *end;
 
+	priv->handshaking = false;
+
 	if (!SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
+		sr_trace(SR_TRACE_HANDSHAKE_CB, priv->id, message->status_code, 0);
 		handshake_failure(s);
 		return;
 	}
 
 	data = message->response_body->data;
 	end = strchr(data, '\n');
+	sr_trace(SR_TRACE_HANDSHAKE_CB, priv->id, message->status_code,
+			end && strncmp(data, "OK", end - data) == 0);
 	if (!end) /* really bad */
 		return;
 
 	if (strncmp(data, "OK", end - data) == 0) {
 		priv->handshake_delay = 1;
 		parse_handshake(s, data);
+		store_handshake(s);
 		sr_session_submit(s);
+		send_now_playing(s);
 	}
 	else if (strncmp(data, "BANNED", end - data) == 0)
 		fatal_error(s, "Client is banned");
@@ -475,10 +1888,21 @@ sr_session_handshake(sr_session_t *s)
 	glong timestamp;
 	gchar *handshake_url;
 	SoupMessage *message;
-	GTimeVal time_val;
 
-	g_get_current_time(&time_val);
-	timestamp = time_val.tv_sec;
+	if (priv->handshaking) {
+		priv->stats.handshakes_avoided++;
+		return;
+	}
+	if (priv->retry_timer) {
+		/* sooner than planned */
+		sr_timeout_remove(priv->retry_timer);
+		priv->retry_timer = 0;
+	}
+
+	priv->handshaking = true;
+	sr_trace(SR_TRACE_HANDSHAKE, priv->id, 0, 0);
+
+	timestamp = sr_clock_now();
 
 	tmp = g_strdup_printf("%s%li", priv->hash_pwd, timestamp);
 	auth = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
@@ -493,20 +1917,341 @@ sr_session_handshake(sr_session_t *s)
 			auth);
 
 	message = soup_message_new("GET", handshake_url);
-	soup_session_queue_message(priv->soup,
-			message,
-			handshake_cb,
-			s);
+	queue_message(s, message, SR_REQUEST_HANDSHAKE, handshake_cb);
 
 	g_free(handshake_url);
 	g_free(auth);
+}
 
-	if (priv->api_key) {
-		if (!priv->session_key)
-			ws_auth(s);
+static size_t
+strings_size(struct sr_session_priv *priv)
+{
+	return str_size(priv->url) + str_size(priv->client_id) +
+		str_size(priv->client_ver) + str_size(priv->user) +
+		str_size(priv->hash_pwd) + str_size(priv->session_id) +
+		str_size(priv->now_playing_url) + str_size(priv->submit_url) +
+		str_size(priv->api_url) + str_size(priv->api_key) +
+		str_size(priv->api_secret) + str_size(priv->session_key) +
+		str_size(priv->archive) + str_size(priv->spill);
+}
+
+/*
+ * Only the thread changing the strings may look at them; the others,
+ * like the loader's enforce_budget(), use the size under the lock.
+ */
+static void
+strings_changed(struct sr_session_priv *priv)
+{
+	size_t size = strings_size(priv);
+
+	g_mutex_lock(priv->queue_mutex);
+	priv->strings_bytes = size;
+	g_mutex_unlock(priv->queue_mutex);
+}
+
+void
+sr_session_get_memory_stats(sr_session_t *s,
+		struct sr_session_memory *m)
+{
+	struct sr_session_priv *priv = s->priv;
+
+	g_mutex_lock(priv->queue_mutex);
+	m->queue = priv->queue_bytes;
+	m->last_track = priv->last_track ? track_size(priv->last_track) : 0;
+	m->strings = priv->strings_bytes;
+	g_mutex_unlock(priv->queue_mutex);
+
+	g_mutex_lock(priv->love_queue_mutex);
+	m->love_queue = priv->love_bytes;
+	g_mutex_unlock(priv->love_queue_mutex);
+
+	m->requests = priv->request_bytes;
+	m->total = m->queue + m->love_queue + m->last_track +
+		m->requests + m->strings;
+}
+
+/*
+ * Must be called with the queue locked. Spilling starts with the newest
+ * tracks, so the ones submitted next stay; evicting starts with the
+ * oldest, which are closer to being too old for the server anyway.
+ * Nothing in flight goes.
+ */
+static void
+enforce_budget(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	FILE *spill = NULL;
+	size_t fixed;
+	unsigned keep;
+	bool spilling;
+	GList *c, *next;
+
+	if (!priv->budget)
+		return;
+
+	/* everything else that can't be evicted */
+	fixed = priv->love_bytes + priv->request_bytes + priv->strings_bytes;
+	if (priv->last_track)
+		fixed += track_size(priv->last_track);
+
+	keep = in_flight_tracks(priv);
+	spilling = priv->budget_policy == SR_BUDGET_SPILL && priv->spill;
+	if (spilling)
+		c = priv->queue->tail;
+	else
+		c = g_queue_peek_nth_link(priv->queue, keep);
+
+	for (; c && fixed + priv->queue_bytes > priv->budget; c = next) {
+		sr_track_t *t = c->data;
+		next = spilling ? c->prev : c->next;
+
+		if (g_queue_get_length(priv->queue) <= keep)
+			break;
+
+		if (spilling && spill_track(priv, &spill, t)) {
+			uint64_t fp = sr_ledger_fingerprint(t);
+			/* only the first time */
+			if (!g_hash_table_remove(priv->returned, &fp))
+				priv->stats.spilled++;
+		}
 		else
-			ws_love(s, true);
+			priv->stats.evicted++;
+
+		priv->queue_bytes -= track_size(t);
+		g_queue_delete_link(priv->queue, c);
+		sr_track_free(t);
+	}
+
+	if (spill)
+		fclose(spill);
+}
+
+/* of the budget; below it, spilled tracks are brought back */
+#define UNSPILL_MARK 2
+
+/*
+ * Brings back the oldest spilled tracks, as many as fit, and leaves the
+ * rest in the file. They are all newer than what's queued.
+ */
+static void
+unspill(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	FILE *f, *rest = NULL;
+	GSequence *back;
+	GSequenceIter *i;
+	size_t used, room, size = 0;
+	sr_track_t *t;
+	char *tmp;
+
+	if (!priv->spill_oldest)
+		return;
+
+	g_mutex_lock(priv->queue_mutex);
+
+	used = priv->queue_bytes + priv->love_bytes + priv->request_bytes +
+		priv->strings_bytes;
+	if (priv->last_track)
+		used += track_size(priv->last_track);
+	if (priv->budget && used > priv->budget / UNSPILL_MARK)
+		goto leave;
+	room = priv->budget ? priv->budget - used : (size_t) -1;
+
+	tmp = g_strconcat(priv->spill, ".tmp", NULL);
+	f = g_rename(priv->spill, tmp) == 0 ? fopen(tmp, "r") : NULL;
+	if (!f) {
+		g_free(tmp);
+		goto leave;
+	}
+
+	priv->spill_oldest = 0;
+	g_hash_table_remove_all(priv->returned);
+	back = g_sequence_new(NULL);
+
+	while ((t = sr_track_read(f))) {
+		if (!track_is_valid(t)) {
+			sr_track_free(t);
+			continue;
+		}
+		g_sequence_insert_sorted(back, t, compare_timestamp, NULL);
+		size += track_size(t);
+
+		/* the newest go back */
+		while (size > room) {
+			i = g_sequence_iter_prev(g_sequence_get_end_iter(back));
+			t = g_sequence_get(i);
+			g_sequence_remove(i);
+			size -= track_size(t);
+			if (!spill_track(priv, &rest, t))
+				priv->stats.evicted++;
+			sr_track_free(t);
+		}
+	}
+	fclose(f);
+	g_unlink(tmp);
+	g_free(tmp);
+	if (rest)
+		fclose(rest);
+
+	for (i = g_sequence_get_begin_iter(back); !g_sequence_iter_is_end(i);
+			i = g_sequence_iter_next(i)) {
+		uint64_t fp;
+
+		t = g_sequence_get(i);
+		if (priv->ledger && sr_ledger_contains(priv->ledger, t)) {
+			sr_track_free(t);
+			priv->stats.already_acked++;
+			continue;
+		}
+		fp = sr_ledger_fingerprint(t);
+		g_hash_table_insert(priv->returned, g_memdup(&fp, sizeof(fp)), NULL);
+		g_queue_push_tail(priv->queue, t);
+		priv->queue_bytes += track_size(t);
+	}
+	g_sequence_free(back);
+
+leave:
+	g_mutex_unlock(priv->queue_mutex);
+}
+
+/* what an earlier run left */
+static unsigned
+oldest_spilled(const char *file)
+{
+	unsigned oldest = 0;
+	sr_track_t *t;
+	FILE *f;
+
+	f = file ? fopen(file, "r") : NULL;
+	if (!f)
+		return 0;
+	while ((t = sr_track_read(f))) {
+		if (track_is_valid(t) && (!oldest || t->timestamp < oldest))
+			oldest = t->timestamp;
+		sr_track_free(t);
+	}
+	fclose(f);
+	return oldest;
+}
+
+void
+sr_session_set_memory_budget(sr_session_t *s,
+		size_t bytes,
+		int policy,
+		const char *spill)
+{
+	struct sr_session_priv *priv = s->priv;
+
+	g_mutex_lock(priv->queue_mutex);
+	priv->budget = bytes;
+	priv->budget_policy = policy;
+	if (g_strcmp0(priv->spill, spill) != 0) {
+		g_free(priv->spill);
+		priv->spill = g_strdup(spill);
+		priv->strings_bytes = strings_size(priv);
+		priv->spill_oldest = oldest_spilled(spill);
+	}
+	enforce_budget(s);
+	g_mutex_unlock(priv->queue_mutex);
+}
+
+static void
+send_now_playing(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+
+	if (!priv->np_pending || !priv->last_track)
+		return;
+	priv->np_pending = false;
+	/* held for too long */
+	if (np_stale(priv->last_track))
+		return;
+	now_playing(s, priv->last_track);
+}
+
+void
+sr_session_flush(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+
+	/* no credentials yet */
+	if (!priv->user)
+		return;
+
+	if (!has_pending(priv))
+		return;
+
+	priv->flushes++;
+
+	/* doesn't need the submission session; also the retry after problems */
+	ws_love(s);
+
+	if (!priv->session_id) {
+		request_handshake(s);
+		return;
+	}
+
+	sr_session_submit(s);
+	send_now_playing(s);
+}
+
+void
+sr_session_hold(sr_session_t *s,
+		int on)
+{
+	struct sr_session_priv *priv = s->priv;
+	priv->held = on;
+}
+
+/* must be called with the queue locked */
+static void
+quarantine_head(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	sr_track_t *t;
+	FILE *f;
+
+	t = g_queue_pop_head(priv->queue);
+	if (!t)
+		return;
+
+	if (priv->quarantine && (f = fopen(priv->quarantine, "a"))) {
+		sr_track_write(t, f);
+		fclose(f);
 	}
+
+	priv->queue_bytes -= track_size(t);
+	sr_track_free(t);
+	priv->stats.quarantined++;
+}
+
+static inline bool
+is_suspect(struct sr_session_priv *priv,
+		sr_track_t *t)
+{
+	return t && t == priv->suspect && t->timestamp == priv->suspect_time;
+}
+
+static inline void
+clear_suspect(struct sr_session_priv *priv)
+{
+	priv->suspect = NULL;
+	priv->strikes = 0;
+	priv->on_trial = false;
+}
+
+/* multiplicative both ways; there are only a few batches to learn from */
+static void
+adapt_batch(struct sr_session_priv *priv,
+		bool ok)
+{
+	unsigned rtt = sr_clock_monotonic() - priv->submit_time;
+
+	if (ok && rtt < SLOW_SUBMIT)
+		priv->batch_limit = MIN(priv->batch_limit * 2, MAX_BATCH);
+	else
+		priv->batch_limit = MAX(priv->batch_limit / 2, 1);
+	priv->stats.batch_limit = priv->batch_limit;
 }
 
 static void
@@ -517,15 +2262,46 @@ drop_submitted(sr_session_t *s)
 
 	g_mutex_lock(priv->queue_mutex);
 	for (c = 0; c < priv->submit_count; c++) {
+		GList *l;
 		sr_track_t *t;
-		t = g_queue_pop_head(priv->queue);
-		if (!t)
+
+		l = g_queue_peek_nth_link(priv->queue, priv->submit_offset);
+		if (!l)
 			break;
+		t = l->data;
+		g_queue_delete_link(priv->queue, l);
+		if (priv->ledger)
+			sr_ledger_add(priv->ledger, t);
+		if (priv->history)
+			sr_history_append(priv->history, t);
+		if (priv->charts)
+			sr_charts_add(priv->charts, t);
+		priv->queue_bytes -= track_size(t);
 		sr_track_free(t);
 	}
+	/* before anything else can fail */
+	if (priv->ledger)
+		sr_ledger_flush(priv->ledger);
+	if (priv->submit_offset)
+		/* the rest went through without it */
+		priv->on_trial = true;
+	else
+		clear_suspect(priv);
 	priv->submit_count = 0;
+	priv->submit_offset = 0;
 	g_mutex_unlock(priv->queue_mutex);
 
+	if (priv->reconnect_time) {
+		priv->stats.reconnect_to_ack = sr_clock_monotonic() - priv->reconnect_time;
+		priv->reconnect_time = 0;
+	}
+
+	if (priv->history)
+		sr_history_flush(priv->history);
+
+	if (g_queue_is_empty(priv->queue))
+		unspill(s);
+
 	if (!g_queue_is_empty(priv->queue))
 		/* still need to submit more */
 		sr_session_submit(s);
@@ -539,7 +2315,11 @@ invalidate_session(sr_session_t *s)
 	struct sr_session_priv *priv = s->priv;
 	g_free(priv->session_id);
 	priv->session_id = NULL;
-	sr_session_handshake(s);
+	strings_changed(priv);
+	/* or the next start would resume the dead one */
+	if (priv->handshake_file)
+		g_unlink(priv->handshake_file);
+	request_handshake(s);
 }
 
 static inline void
@@ -551,6 +2331,62 @@ hard_failure(sr_session_t *s)
 		invalidate_session(s);
 }
 
+/*
+ * The server didn't like something in the batch. That's also what an
+ * unhealthy server says, so nothing is resent from here; the batch is
+ * halved and the normal retries carry on. Once the head has been refused
+ * alone in QUARANTINE_STRIKES different flushes, the tracks behind it are
+ * tried without it; if those go through, the head gets one last try
+ * alone, and only if that's refused too it is quarantined.
+ */
+static void
+rejected(sr_session_t *s)
+{
+	struct sr_session_priv *priv = s->priv;
+	int count, offset;
+	sr_track_t *head;
+
+	priv->stats.rejected++;
+	hard_failure(s);
+
+	g_mutex_lock(priv->queue_mutex);
+	count = priv->submit_count;
+	offset = priv->submit_offset;
+	priv->submit_count = 0;
+	priv->submit_offset = 0;
+	head = g_queue_peek_head(priv->queue);
+
+	if (offset) {
+		/* refused without the head as well */
+		clear_suspect(priv);
+	}
+	else if (count == 1 && head) {
+		if (priv->on_trial && is_suspect(priv, head)) {
+			/* right after the others went through */
+			quarantine_head(s);
+			clear_suspect(priv);
+		}
+		else {
+			if (!is_suspect(priv, head)) {
+				clear_suspect(priv);
+				priv->suspect = head;
+				priv->suspect_time = head->timestamp;
+			}
+			if (priv->strike_flush != priv->flushes || !priv->strikes) {
+				priv->strikes++;
+				priv->strike_flush = priv->flushes;
+			}
+			if (priv->strikes >= QUARANTINE_STRIKES &&
+					g_queue_get_length(priv->queue) > 1)
+				priv->skip_head = true;
+		}
+	}
+	g_mutex_unlock(priv->queue_mutex);
+
+	priv->batch_limit = MAX(count / 2, 1);
+	priv->stats.batch_limit = priv->batch_limit;
+}
+
 static void
 scrobble_cb(SoupSession *session,
 		SoupMessage *message,
@@ -560,27 +2396,41 @@ scrobble_cb(SoupSession *session,
 	struct sr_session_priv *priv = s->priv;
 	const char *data, *end;
 
+	priv->request_bytes -= message->request_body->length;
+
 	if (!SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
+		sr_trace(SR_TRACE_SCROBBLE_CB, priv->id, message->status_code, 0);
+		adapt_batch(priv, false);
 		hard_failure(s);
 		goto nok;
 	}
 
 	data = message->response_body->data;
 	end = strchr(data, '\n');
+	sr_trace(SR_TRACE_SCROBBLE_CB, priv->id, message->status_code,
+			end && strncmp(data, "OK", end - data) == 0);
 	if (!end) /* really bad */
 		goto nok;
 
 	if (strncmp(data, "OK", end - data) == 0) {
+		adapt_batch(priv, true);
 		drop_submitted(user_data);
 		return;
 	}
 	else if (strncmp(data, "BADSESSION", end - data) == 0)
 		invalidate_session(s);
-	else
+	else if (strncmp(data, "FAILED", 6) == 0) {
+		rejected(s);
+		return;
+	}
+	else {
+		adapt_batch(priv, false);
 		hard_failure(s);
+	}
 nok:
 	g_mutex_lock(priv->queue_mutex);
 	priv->submit_count = 0;
+	priv->submit_offset = 0;
 	g_mutex_unlock(priv->queue_mutex);
 
 }
@@ -602,14 +2452,28 @@ sr_session_submit(sr_session_t *s)
 	SoupMessage *message;
 	int i = 0;
 	GString *data;
-	GList *c;
+	GList *c, *next;
 
 	/* haven't got the session yet? */
 	if (!priv->session_id)
 		return;
 
+	if (!priv->submit_count)
+		unspill(s);
+
 	g_mutex_lock(priv->queue_mutex);
-	if (g_queue_is_empty(priv->queue) || priv->submit_count) {
+	if (priv->submit_count) {
+		g_mutex_unlock(priv->queue_mutex);
+		return;
+	}
+
+	prune_queue(s);
+
+	priv->submit_offset = priv->skip_head ? 1 : 0;
+	priv->skip_head = false;
+	c = g_queue_peek_nth_link(priv->queue, priv->submit_offset);
+	if (!c) {
+		priv->submit_offset = 0;
 		g_mutex_unlock(priv->queue_mutex);
 		return;
 	}
@@ -617,11 +2481,22 @@ sr_session_submit(sr_session_t *s)
 	data = g_string_new(NULL);
 	g_string_append_printf(data, "s=%s", priv->session_id);
 
-	for (c = priv->queue->head; c; c = c->next) {
+	for (; c; c = next) {
 		sr_track_t *t = c->data;
 		char *artist, *title;
 		char *album = NULL, *mbid = NULL;
 
+		next = c->next;
+
+		/* acknowledged before, but the queue wasn't stored after that */
+		if (priv->ledger && sr_ledger_contains(priv->ledger, t)) {
+			priv->queue_bytes -= track_size(t);
+			g_queue_delete_link(priv->queue, c);
+			sr_track_free(t);
+			priv->stats.already_acked++;
+			continue;
+		}
+
 		artist = soup_uri_encode(t->artist, EXTRA_URI_ENCODE_CHARS);
 		title = soup_uri_encode(t->title, EXTRA_URI_ENCODE_CHARS);
 		if (t->album)
@@ -648,23 +2523,34 @@ sr_session_submit(sr_session_t *s)
 		g_free(album);
 		g_free(mbid);
 
-		if (++i >= 50)
+		if (++i >= priv->batch_limit || data->len >= SUBMIT_BYTES)
 			break;
+		if (priv->on_trial && !priv->submit_offset)
+			break;
+	}
+
+	if (!i) {
+		/* all of them were acknowledged already */
+		priv->submit_offset = 0;
+		g_mutex_unlock(priv->queue_mutex);
+		g_string_free(data, true);
+		return;
 	}
 	priv->submit_count = i;
+	priv->submit_time = sr_clock_monotonic();
 
 	g_mutex_unlock(priv->queue_mutex);
 
+	sr_trace(SR_TRACE_SUBMIT_REQ, priv->id, i, 0);
+
 	message = soup_message_new("POST", priv->submit_url);
 	soup_message_set_request(message,
 			"application/x-www-form-urlencoded",
 			SOUP_MEMORY_TAKE,
 			data->str,
 			data->len);
-	soup_session_queue_message(priv->soup,
-			message,
-			scrobble_cb,
-			s);
+	priv->request_bytes += message->request_body->length;
+	queue_message(s, message, SR_REQUEST_SUBMIT, scrobble_cb);
 	g_string_free(data, false); /* soup gets ownership */
 }
 
@@ -674,8 +2560,11 @@ now_playing_cb(SoupSession *session,
 		void *user_data)
 {
 	sr_session_t *s = user_data;
+	struct sr_session_priv *priv = s->priv;
 	const char *data, *end;
 
+	priv->request_bytes -= message->request_body->length;
+
 	if (!SOUP_STATUS_IS_SUCCESSFUL(message->status_code))
 		/* now need to do anything drastic, right? */
 		return;
@@ -736,19 +2625,43 @@ now_playing(sr_session_t *s,
 	g_free(album);
 	g_free(mbid);
 
+	sr_trace(SR_TRACE_NOW_PLAYING, priv->id, 0, 0);
+
 	message = soup_message_new("POST", priv->now_playing_url);
 	soup_message_set_request(message,
 			"application/x-www-form-urlencoded",
 			SOUP_MEMORY_TAKE,
 			data->str,
 			data->len);
-	soup_session_queue_message(priv->soup,
-			message,
-			now_playing_cb,
-			s);
+	priv->request_bytes += message->request_body->length;
+	queue_message(s, message, SR_REQUEST_NOW_PLAYING, now_playing_cb);
 	g_string_free(data, false); /* soup gets ownership */
 }
 
+void
+sr_session_set_history(sr_session_t *s, sr_history_t *h)
+{
+	struct sr_session_priv *priv = s->priv;
+	priv->history = h;
+}
+
+void
+sr_session_set_ledger(sr_session_t *s, sr_ledger_t *l)
+{
+	struct sr_session_priv *priv = s->priv;
+	/* might be a loader thread */
+	g_mutex_lock(priv->queue_mutex);
+	priv->ledger = l;
+	g_mutex_unlock(priv->queue_mutex);
+}
+
+void
+sr_session_set_charts(sr_session_t *s, sr_charts_t *c)
+{
+	struct sr_session_priv *priv = s->priv;
+	priv->charts = c;
+}
+
 void
 sr_session_set_proxy(sr_session_t *s, const char *url)
 {
@@ -768,7 +2681,9 @@ sr_session_set_session_key(sr_session_t *s,
 		const char *session_key)
 {
 	struct sr_session_priv *priv = s->priv;
+	g_free(priv->session_key);
 	priv->session_key = g_strdup(session_key);
+	strings_changed(priv);
 }
 
 void
@@ -778,9 +2693,13 @@ sr_session_set_api(sr_session_t *s,
 		const char *api_secret)
 {
 	struct sr_session_priv *priv = s->priv;
+	g_free(priv->api_url);
+	g_free(priv->api_key);
+	g_free(priv->api_secret);
 	priv->api_url = g_strdup(api_url);
 	priv->api_key = g_strdup(api_key);
 	priv->api_secret = g_strdup(api_secret);
+	strings_changed(priv);
 }
 
 struct ws_param {
@@ -866,6 +2785,8 @@ ws_auth_cb(SoupSession *session,
 	struct sr_session_priv *priv = s->priv;
 	const char *data, *begin, *end;
 
+	priv->authing = false;
+
 	if (!SOUP_STATUS_IS_SUCCESSFUL(message->status_code))
 		return;
 
@@ -879,8 +2800,12 @@ ws_auth_cb(SoupSession *session,
 	if (!end) /* really bad */
 		return;
 	priv->session_key = g_strndup(begin, end - begin);
+	strings_changed(priv);
 	if (s->session_key_cb)
 		s->session_key_cb(s, priv->session_key);
+
+	/* loves queued meanwhile */
+	ws_love(s);
 }
 
 static void
@@ -893,6 +2818,10 @@ ws_auth(sr_session_t *s)
 
 	gchar *params;
 
+	if (priv->authing)
+		return;
+	priv->authing = true;
+
 	tmp = g_strdup_printf("%s%s", priv->user, priv->hash_pwd);
 	auth = g_compute_checksum_for_string(G_CHECKSUM_MD5, tmp, -1);
 	g_free(tmp);
@@ -910,10 +2839,7 @@ ws_auth(sr_session_t *s)
 	g_free(params);
 
 	message = soup_message_new("GET", auth_url);
-	soup_session_queue_message(priv->soup,
-			message,
-			ws_auth_cb,
-			s);
+	queue_message(s, message, SR_REQUEST_WS, ws_auth_cb);
 
 	g_free(auth_url);
 	g_free(auth);
@@ -928,30 +2854,45 @@ ws_love_cb(SoupSession *session,
 	struct sr_session_priv *priv = s->priv;
 	sr_track_t *t;
 
+	priv->request_bytes -= message->request_body->length;
+	priv->loving = false;
+
 	if (!SOUP_STATUS_IS_SUCCESSFUL(message->status_code)) {
+		sr_trace(SR_TRACE_LOVE_CB, priv->id, message->status_code,
+				g_queue_get_length(priv->love_queue));
 		priv->api_problems = true;
 		return;
 	}
 
 	g_mutex_lock(priv->love_queue_mutex);
 	t = g_queue_pop_head(priv->love_queue);
+	if (t)
+		priv->love_bytes -= track_size(t);
 	g_mutex_unlock(priv->love_queue_mutex);
 	sr_track_free(t);
 
+	sr_trace(SR_TRACE_LOVE_CB, priv->id, message->status_code,
+			g_queue_get_length(priv->love_queue));
+
 	priv->api_problems = false;
 
 	if (!g_queue_is_empty(priv->love_queue))
 		/* still need to submit more */
-		ws_love(s, true);
+		ws_love(s);
 }
 
 static void
-ws_love(sr_session_t *s, bool on)
+ws_love(sr_session_t *s)
 {
 	struct sr_session_priv *priv = s->priv;
 	SoupMessage *message;
 	gchar *params;
 	sr_track_t *t;
+	bool on;
+
+	/* the callback continues with the rest */
+	if (priv->loving || !priv->api_key)
+		return;
 
 	g_mutex_lock(priv->love_queue_mutex);
 	t = g_queue_peek_head(priv->love_queue);
@@ -960,6 +2901,18 @@ ws_love(sr_session_t *s, bool on)
 	if (!t)
 		return;
 
+	/* only when there's something to love */
+	if (!priv->session_key) {
+		if (priv->user)
+			ws_auth(s);
+		return;
+	}
+
+	on = t->rating == 'L';
+	priv->loving = true;
+
+	sr_trace(SR_TRACE_LOVE, priv->id, on, 0);
+
 	ws_params(s, &params,
 			"method", on ? "track.love" : "track.unlove",
 			"api_key", priv->api_key,
@@ -974,10 +2927,8 @@ ws_love(sr_session_t *s, bool on)
 			SOUP_MEMORY_TAKE,
 			params,
 			strlen(params));
-	soup_session_queue_message(priv->soup,
-			message,
-			ws_love_cb,
-			s);
+	priv->request_bytes += message->request_body->length;
+	queue_message(s, message, SR_REQUEST_WS, ws_love_cb);
 }
 
 void
@@ -1001,11 +2952,13 @@ sr_session_love(sr_session_t *s, const char *artist, const char *title, int on)
 	t = sr_track_new();
 	t->artist = g_strdup(artist);
 	t->title = g_strdup(title);
+	t->rating = on ? 'L' : '\0';
 
 	g_mutex_lock(priv->love_queue_mutex);
 	g_queue_push_tail(priv->love_queue, t);
+	priv->love_bytes += track_size(t);
 	g_mutex_unlock(priv->love_queue_mutex);
 
-	if (!priv->api_problems)
-		ws_love(s, on);
+	if (!priv->api_problems && !priv->held)
+		ws_love(s);
 }
@@ -7,6 +7,8 @@
 #ifndef SCROBBLE_H
 #define SCROBBLE_H
 
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -31,6 +33,9 @@ struct sr_track {
 };
 
 typedef struct sr_session sr_session_t;
+typedef struct sr_history sr_history_t;
+typedef struct sr_charts sr_charts_t;
+typedef struct sr_ledger sr_ledger_t;
 
 struct sr_session {
 	void *priv;
@@ -40,26 +45,146 @@ struct sr_session {
 	void (*session_key_cb) (sr_session_t *s, const char *session_key);
 };
 
+struct sr_session_stats {
+	unsigned expired; /* dropped by the retention policy */
+	unsigned spilled; /* moved to disk by the memory budget */
+	unsigned evicted; /* dropped by the memory budget */
+	unsigned resumed; /* handshakes avoided with the handshake cache */
+	unsigned reconnect_to_ack; /* msec, last measured */
+	unsigned warm_ups; /* hosts prepared when the network came back */
+	unsigned batch_limit; /* tracks in the next submission, at most */
+	unsigned rejected; /* submissions the server refused */
+	unsigned quarantined; /* tracks it kept refusing */
+	unsigned already_acked; /* found in the ledger, so not submitted again */
+	unsigned windows; /* radio wake-ups started by this session */
+	unsigned handshakes_avoided; /* one was in flight, or nothing to send */
+	unsigned stalls; /* requests cancelled by the watchdog */
+	unsigned stall_time; /* msec, total */
+	unsigned longest_stall; /* msec */
+	/* msec, from queued to answered, over the last ones */
+	unsigned np_latency_p50;
+	unsigned np_latency_p90;
+	unsigned np_latency_max;
+};
+
+/* estimates, in bytes; the allocator's overhead isn't counted */
+struct sr_session_memory {
+	size_t queue;
+	size_t love_queue;
+	size_t last_track;
+	size_t requests; /* bodies held by libsoup */
+	size_t strings;
+	size_t total;
+};
+
+struct sr_import_stats {
+	unsigned lines;
+	unsigned queued;
+	unsigned skipped; /* marked as skipped by the player */
+	unsigned invalid;
+	unsigned duplicates; /* already queued or acknowledged, or repeated */
+};
+
+enum sr_budget_policy {
+	SR_BUDGET_EVICT,
+	SR_BUDGET_SPILL,
+};
+
+enum sr_request_kind {
+	SR_REQUEST_HANDSHAKE,
+	SR_REQUEST_SUBMIT,
+	SR_REQUEST_NOW_PLAYING,
+	SR_REQUEST_WS, /* web-service: auth and love */
+	SR_REQUEST_LAST,
+};
+
+enum sr_export_format {
+	SR_EXPORT_JSONL,
+	SR_EXPORT_CSV,
+};
+
+enum sr_export_set {
+	SR_EXPORT_QUEUE = 1 << 0,
+	SR_EXPORT_LOVE = 1 << 1,
+	SR_EXPORT_HISTORY = 1 << 2, /* acked, needs a history */
+};
+
 sr_session_t *sr_session_new(const char *url,
 		const char *client_id,
 		const char *client_ver);
 void sr_session_free(sr_session_t *s);
+void sr_session_set_url(sr_session_t *s, const char *url);
 void sr_session_set_cred(sr_session_t *s, char *user, char *password);
 void sr_session_set_cred_hash(sr_session_t *s, char *user, char *hash_pwd);
 
 void sr_session_add_track(sr_session_t *s, sr_track_t *t);
+/* only announce it, takes ownership; NULL when nothing is playing */
+void sr_session_now_playing(sr_session_t *s, sr_track_t *t);
+/*
+ * Already played tracks, takes ownership; returns how many were valid.
+ * Tracks without a timestamp, or with one in the future, are not.
+ */
+int sr_session_queue_tracks(sr_session_t *s, sr_track_t **tracks, unsigned count);
 int sr_session_load_list(sr_session_t *s, const char *file);
 int sr_session_store_list(sr_session_t *s, const char *file);
+/*
+ * .scrobbler.log from a portable player; returns 1 if it can't be read,
+ * 2 if it isn't AUDIOSCROBBLER/1.1.
+ */
+int sr_session_import_log(sr_session_t *s,
+		const char *file,
+		struct sr_import_stats *stats);
 void sr_session_pause(sr_session_t *s);
+void sr_session_set_retention(sr_session_t *s,
+		unsigned max_age,
+		unsigned max_count,
+		const char *archive);
+/* where tracks the server refuses go; otherwise they are dropped */
+void sr_session_set_quarantine(sr_session_t *s, const char *file);
+void sr_session_get_stats(sr_session_t *s, struct sr_session_stats *stats);
+void sr_session_get_memory_stats(sr_session_t *s, struct sr_session_memory *m);
+/*
+ * An estimate of what the queues take is kept under 'bytes'; past it, the
+ * newest tracks are moved to 'spill', or the oldest are dropped.
+ */
+void sr_session_set_memory_budget(sr_session_t *s,
+		size_t bytes,
+		int policy,
+		const char *spill);
 void sr_session_test(sr_session_t *s);
+/* returns how many records were written */
+int sr_session_export(sr_session_t *s, FILE *f, int format, int what);
 
 sr_track_t *sr_track_new(void);
 void sr_track_free(sr_track_t *t);
 sr_track_t *sr_track_dup(sr_track_t *in);
+/* how many times tracks were copied, process-wide */
+unsigned sr_track_copies(void);
+int sr_track_played(sr_track_t *t, unsigned end);
+sr_track_t *sr_track_read(FILE *f);
+void sr_track_write(sr_track_t *t, FILE *f);
 
 void sr_session_handshake(sr_session_t *s);
 void sr_session_submit(sr_session_t *s);
+void sr_session_flush(sr_session_t *s);
+/* while held, nothing is sent until the next flush */
+void sr_session_hold(sr_session_t *s, int on);
+void sr_session_set_handshake_cache(sr_session_t *s,
+		const char *file,
+		unsigned validity);
+/*
+ * Requests taking longer are cancelled and retried; 0 means no limit, and
+ * a negative value restores the default.
+ */
+void sr_session_set_timeout(sr_session_t *s, int kind, int sec);
+/* the network is back; prepares the connections if there's work to do */
+void sr_session_reconnected(sr_session_t *s);
 void sr_session_set_proxy(sr_session_t *s, const char *url);
+void sr_session_set_history(sr_session_t *s, sr_history_t *h);
+/* fed with what the server acknowledged */
+void sr_session_set_charts(sr_session_t *s, sr_charts_t *c);
+/* acknowledged tracks are recorded there, and never submitted again */
+void sr_session_set_ledger(sr_session_t *s, sr_ledger_t *l);
 
 void sr_session_set_api(sr_session_t *s,
 		const char *api_url,
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#ifndef SCROBBLE_HPP
+#define SCROBBLE_HPP
+
+/*
+ * Thin C++ owners for the C API. They are move-only so that a track built
+ * on the C++ side reaches the library without any string being copied;
+ * dup() is the only way to get a second one.
+ */
+
+#include <glib.h>
+
+#include "scrobble.h"
+
+namespace sr {
+
+/* a g_malloc'ed string */
+class String {
+public:
+	explicit String(char *str = NULL) : str(str) { }
+	String(String &&o) : str(o.release()) { }
+	~String() { g_free(str); }
+
+	String &operator=(String &&o)
+	{
+		reset(o.release());
+		return *this;
+	}
+
+	const char *get() const { return str; }
+	char *release() { char *r = str; str = NULL; return r; }
+	void reset(char *s = NULL) { g_free(str); str = s; }
+
+private:
+	String(const String &);
+	String &operator=(const String &);
+
+	char *str;
+};
+
+class Track {
+public:
+	Track() : t(sr_track_new()) { }
+	explicit Track(sr_track_t *t) : t(t) { }
+	Track(Track &&o) : t(o.release()) { }
+	~Track() { sr_track_free(t); }
+
+	Track &operator=(Track &&o)
+	{
+		if (this != &o) {
+			sr_track_free(t);
+			t = o.release();
+		}
+		return *this;
+	}
+
+	Track dup() const { return Track(sr_track_dup(t)); }
+
+	sr_track_t *get() const { return t; }
+	sr_track_t *release() { sr_track_t *r = t; t = NULL; return r; }
+
+	const char *artist() const { return t->artist; }
+	const char *title() const { return t->title; }
+	const char *album() const { return t->album; }
+	int length() const { return t->length; }
+	unsigned timestamp() const { return t->timestamp; }
+
+	void set_artist(String &&v) { take(t->artist, v); }
+	void set_title(String &&v) { take(t->title, v); }
+	void set_album(String &&v) { take(t->album, v); }
+	void set_mbid(String &&v) { take(t->mbid, v); }
+	void set_length(int v) { t->length = v; }
+	void set_timestamp(unsigned v) { t->timestamp = v; }
+	void set_source(char v) { t->source = v; }
+	void set_rating(char v) { t->rating = v; }
+
+	bool played(unsigned end) const { return sr_track_played(t, end); }
+
+private:
+	Track(const Track &);
+	Track &operator=(const Track &);
+
+	static void take(char *&field, String &v)
+	{
+		g_free(field);
+		field = v.release();
+	}
+
+	sr_track_t *t;
+};
+
+class Session {
+public:
+	Session(const char *url, const char *client_id, const char *client_ver) :
+		s(sr_session_new(url, client_id, client_ver)) { }
+	Session(Session &&o) : s(o.s) { o.s = NULL; }
+	~Session() { if (s) sr_session_free(s); }
+
+	sr_session_t *get() const { return s; }
+
+	/* returns whether it was valid */
+	bool queue(Track &&t)
+	{
+		sr_track_t *p = t.release();
+		return sr_session_queue_tracks(s, &p, 1);
+	}
+
+	void now_playing(Track &&t) { sr_session_now_playing(s, t.release()); }
+	void love(const char *artist, const char *title, bool on)
+	{
+		sr_session_love(s, artist, title, on);
+	}
+	void flush() { sr_session_flush(s); }
+
+private:
+	Session(const Session &);
+	Session &operator=(const Session &);
+
+	sr_session_t *s;
+};
+
+} /* namespace sr */
+
+#endif /* SCROBBLE_HPP */
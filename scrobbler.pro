@@ -1,14 +1,16 @@
 CONFIG += qt
-SOURCES += m6_main.cpp helper.c scrobble.c
-HEADERS += m6_main.h helper.h scrobble.h
+SOURCES += m6_main.cpp helper.c scrobble.c history.c charts.c ledger.c trace.c clock.c
+HEADERS += m6_main.h helper.h scrobble.h scrobble.hpp history.h charts.h ledger.h trace.h clock.h
 
 CONFIG += link_pkgconfig
 PKGCONFIG += qmafw qmafw-shared glib-2.0 gio-2.0 libsoup-2.4 conic qmafw-tracker-util
 
+LIBS += -lrt
+
 TARGET = scrobbler
 
 target.path = /usr/bin
 INSTALLS += target
 
 QMAKE_CFLAGS += -std=c99 -Wno-unused-parameter
-QMAKE_CXXFLAGS += -Wno-unused-parameter
+QMAKE_CXXFLAGS += -std=c++0x -Wno-unused-parameter
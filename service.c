@@ -2,9 +2,21 @@
 #include <dbus/dbus-glib-bindings.h>
 
 #include "helper.h"
+#include "history.h"
+#include "charts.h"
+#include "marshal.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 static void *parent_class;
 
+/* entries a client can ask for at once */
+#define MAX_TOP 64
+
 void
 sr_service_next(struct sr_service *service)
 {
@@ -13,13 +25,266 @@ sr_service_next(struct sr_service *service)
 	g_signal_emit(G_OBJECT(service), class->next_sig, 0, service);
 }
 
+void
+sr_service_now_playing(struct sr_service *service,
+		sr_track_t *t,
+		bool loved)
+{
+	struct sr_service_class *class;
+	class = g_type_class_peek(SR_SERVICE_TYPE);
+	g_signal_emit(G_OBJECT(service), class->now_playing_sig, 0,
+			t && t->artist ? t->artist : "",
+			t && t->title ? t->title : "",
+			t && t->album ? t->album : "",
+			t ? MAX(t->length, 0) : 0,
+			loved);
+}
+
+static gboolean
+sr_service_get_current(struct sr_service *service,
+		char **artist, char **title, char **album,
+		guint *length, gboolean *loved, GError **error)
+{
+	sr_track_t *t;
+	bool l;
+
+	t = hp_get_current(&l);
+	*artist = g_strdup(t && t->artist ? t->artist : "");
+	*title = g_strdup(t && t->title ? t->title : "");
+	*album = g_strdup(t && t->album ? t->album : "");
+	*length = t ? MAX(t->length, 0) : 0;
+	*loved = t ? l : FALSE;
+	return TRUE;
+}
+
 static gboolean
 sr_service_love(struct sr_service *service, gboolean on)
 {
-	hp_love(on);
+	hp_love_current(on);
+	return TRUE;
+}
+
+static char *
+dup_field(GValueArray *v, unsigned i)
+{
+	const char *str = g_value_get_string(g_value_array_get_nth(v, i));
+	return str && str[0] ? g_strdup(str) : NULL;
+}
+
+static gboolean
+sr_service_submit_tracks(struct sr_service *service,
+		GPtrArray *tracks, guint *queued, GError **error)
+{
+	sr_track_t **list;
+	unsigned i;
+
+	list = g_new(sr_track_t *, tracks->len);
+	for (i = 0; i < tracks->len; i++) {
+		GValueArray *v = g_ptr_array_index(tracks, i);
+		sr_track_t *t;
+
+		list[i] = t = sr_track_new();
+		t->artist = dup_field(v, 0);
+		t->title = dup_field(v, 1);
+		t->album = dup_field(v, 2);
+		t->mbid = dup_field(v, 3);
+		t->timestamp = g_value_get_uint(g_value_array_get_nth(v, 4));
+		t->length = g_value_get_int(g_value_array_get_nth(v, 5));
+		t->position = g_value_get_int(g_value_array_get_nth(v, 6));
+	}
+
+	*queued = hp_submit_tracks(list, tracks->len);
+	g_free(list);
+	return TRUE;
+}
+
+static gboolean
+sr_service_love_many(struct sr_service *service,
+		GPtrArray *tracks, GError **error)
+{
+	for (unsigned i = 0; i < tracks->len; i++) {
+		GValueArray *v = g_ptr_array_index(tracks, i);
+		hp_love(g_value_get_string(g_value_array_get_nth(v, 0)),
+				g_value_get_string(g_value_array_get_nth(v, 1)),
+				g_value_get_boolean(g_value_array_get_nth(v, 2)));
+	}
+	return TRUE;
+}
+
+static gboolean
+sr_service_dump_trace(struct sr_service *service,
+		char **file, GError **error)
+{
+	const char *trace = hp_dump_trace();
+	*file = g_strdup(trace ? trace : "");
+	return TRUE;
+}
+
+static void
+append_string(GValueArray *array, const char *str)
+{
+	GValue value = { 0 };
+	g_value_init(&value, G_TYPE_STRING);
+	g_value_set_string(&value, str ? str : "");
+	g_value_array_append(array, &value);
+	g_value_unset(&value);
+}
+
+static void
+append_uint(GValueArray *array, unsigned u)
+{
+	GValue value = { 0 };
+	g_value_init(&value, G_TYPE_UINT);
+	g_value_set_uint(&value, u);
+	g_value_array_append(array, &value);
+	g_value_unset(&value);
+}
+
+static void
+add_history_track(sr_track_t *t, void *user_data)
+{
+	GPtrArray *tracks = user_data;
+	GValueArray *track;
+
+	track = g_value_array_new(3);
+	append_string(track, t->artist);
+	append_string(track, t->title);
+	append_uint(track, t->timestamp);
+	g_ptr_array_add(tracks, track);
+}
+
+static gboolean
+sr_service_get_history(struct sr_service *service,
+		const char *id, guint from, guint to, guint offset, guint count,
+		GPtrArray **tracks, GError **error)
+{
+	sr_history_t *history;
+
+	*tracks = g_ptr_array_new();
+	history = hp_get_history(id);
+	if (!history || !count)
+		return TRUE;
+
+	count = MIN(count, MAX_TOP);
+	sr_history_page(history, from, to, offset, count, add_history_track, *tracks);
+	return TRUE;
+}
+
+static gboolean
+sr_service_get_top_artists(struct sr_service *service,
+		const char *id, guint from, guint to, guint count,
+		GPtrArray **artists, GError **error)
+{
+	sr_history_t *history;
+	struct sr_artist_count *top;
+	unsigned i, n;
+
+	*artists = g_ptr_array_new();
+	history = hp_get_history(id);
+	if (!history || !count)
+		return TRUE;
+
+	count = MIN(count, MAX_TOP);
+	top = g_new(struct sr_artist_count, count);
+	n = sr_history_top_artists(history, from, to, top, count);
+	for (i = 0; i < n; i++) {
+		GValueArray *artist;
+		artist = g_value_array_new(2);
+		append_string(artist, top[i].artist);
+		append_uint(artist, top[i].count);
+		g_ptr_array_add(*artists, artist);
+	}
+	g_free(top);
+	return TRUE;
+}
+
+static gboolean
+sr_service_get_charts(struct sr_service *service,
+		const char *id, const char *window, const char *kind, guint count,
+		guint *start, GPtrArray **entries, GError **error)
+{
+	sr_charts_t *charts;
+	struct sr_charts_entry *top;
+	unsigned i, n;
+
+	*start = 0;
+	*entries = g_ptr_array_new();
+	charts = hp_get_charts(id);
+	if (!charts || !count)
+		return TRUE;
+
+	count = MIN(count, MAX_TOP);
+	top = g_new(struct sr_charts_entry, count);
+	n = sr_charts_top(charts,
+			strcmp(window, "month") == 0 ? SR_CHARTS_MONTH : SR_CHARTS_WEEK,
+			strcmp(kind, "tracks") == 0 ? SR_CHARTS_TRACKS : SR_CHARTS_ARTISTS,
+			top, count, start);
+	for (i = 0; i < n; i++) {
+		GValueArray *entry;
+		entry = g_value_array_new(4);
+		append_string(entry, top[i].artist);
+		append_string(entry, top[i].title);
+		append_uint(entry, top[i].count);
+		append_uint(entry, top[i].error);
+		g_ptr_array_add(*entries, entry);
+	}
+	g_free(top);
 	return TRUE;
 }
 
+static void
+export_done(int count,
+		void *data)
+{
+	DBusGMethodInvocation *context = data;
+	GError *error;
+
+	if (count >= 0) {
+		dbus_g_method_return(context, (guint) count);
+		return;
+	}
+	error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_FAILED,
+			"export failed or interrupted");
+	dbus_g_method_return_error(context, error);
+	g_error_free(error);
+}
+
+/* only to new files */
+static void
+sr_service_export(struct sr_service *service,
+		const char *id, const char *file, const char *format,
+		DBusGMethodInvocation *context)
+{
+	GError *error = NULL;
+	FILE *f;
+	int fd;
+
+	if (!hp_get_session(id)) {
+		error = g_error_new(G_FILE_ERROR, G_FILE_ERROR_NOENT,
+				"no such service: %s", id);
+		goto fail;
+	}
+
+	fd = open(file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0 || !(f = fdopen(fd, "w"))) {
+		int err = errno;
+		if (fd >= 0)
+			close(fd);
+		error = g_error_new(G_FILE_ERROR, g_file_error_from_errno(err),
+				"%s: %s", file, g_strerror(err));
+		goto fail;
+	}
+
+	hp_export(id, f,
+			strcmp(format, "csv") == 0 ? SR_EXPORT_CSV : SR_EXPORT_JSONL,
+			export_done, context);
+	return;
+
+fail:
+	dbus_g_method_return_error(context, error);
+	g_error_free(error);
+}
+
 #include "service_glue.h"
 
 static void
@@ -60,6 +325,14 @@ class_init(void *g_class,
 			0, NULL, NULL,
 			g_cclosure_marshal_VOID__VOID,
 			G_TYPE_NONE, 0);
+
+	service_class->now_playing_sig = g_signal_new("now-playing", G_OBJECT_CLASS_TYPE(g_class),
+			G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
+			0, NULL, NULL,
+			sr_marshal_VOID__STRING_STRING_STRING_UINT_BOOLEAN,
+			G_TYPE_NONE, 5,
+			G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+			G_TYPE_UINT, G_TYPE_BOOLEAN);
 }
 
 GType
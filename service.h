@@ -2,6 +2,9 @@
 #define SR_SERVICE_H
 
 #include <glib-object.h>
+#include <stdbool.h>
+
+#include "scrobble.h"
 
 struct sr_service {
 	GObject parent;
@@ -13,6 +16,7 @@ struct sr_service_class {
 	GObjectClass parent_class;
 	void *connection;
 	guint next_sig;
+	guint now_playing_sig;
 };
 
 #define SR_SERVICE_TYPE (sr_service_get_type())
@@ -21,6 +25,7 @@ struct sr_service_class {
 #define SR_SERVICE_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS((obj), SR_SERVICE_TYPE, struct sr_service_class))
 
 void sr_service_next(struct sr_service *service);
+void sr_service_now_playing(struct sr_service *service, sr_track_t *t, bool loved);
 
 GType sr_service_get_type(void);
 
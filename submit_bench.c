@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+/*
+ * Measures the throughput of the SubmitTracks D-Bus method.
+ *
+ * The tracks are real submissions, so run the daemon with a throwaway
+ * configuration, e.g. one pointing to a local stand-in server.
+ */
+
+#include <glib.h>
+#include <glib-object.h>
+#include <dbus/dbus-glib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+static void
+append_string(GValueArray *array, const char *str)
+{
+	GValue value = { 0 };
+	g_value_init(&value, G_TYPE_STRING);
+	g_value_set_string(&value, str);
+	g_value_array_append(array, &value);
+	g_value_unset(&value);
+}
+
+static void
+append_uint(GValueArray *array, unsigned u)
+{
+	GValue value = { 0 };
+	g_value_init(&value, G_TYPE_UINT);
+	g_value_set_uint(&value, u);
+	g_value_array_append(array, &value);
+	g_value_unset(&value);
+}
+
+static void
+append_int(GValueArray *array, int i)
+{
+	GValue value = { 0 };
+	g_value_init(&value, G_TYPE_INT);
+	g_value_set_int(&value, i);
+	g_value_array_append(array, &value);
+	g_value_unset(&value);
+}
+
+static GPtrArray *
+build_tracks(unsigned count, unsigned start)
+{
+	GPtrArray *tracks;
+
+	tracks = g_ptr_array_sized_new(count);
+	for (unsigned i = 0; i < count; i++) {
+		GValueArray *track;
+		char *title;
+
+		title = g_strdup_printf("Track %u", i);
+		track = g_value_array_new(7);
+		append_string(track, "Benchmark");
+		append_string(track, title);
+		append_string(track, "Throughput");
+		append_string(track, "");
+		append_uint(track, start + i * 240);
+		append_int(track, 240);
+		append_int(track, i + 1);
+		g_ptr_array_add(tracks, track);
+		g_free(title);
+	}
+	return tracks;
+}
+
+static void
+free_tracks(GPtrArray *tracks)
+{
+	g_ptr_array_foreach(tracks, (GFunc) g_value_array_free, NULL);
+	g_ptr_array_free(tracks, TRUE);
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n tracks-per-call] [-c calls]\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	DBusGConnection *bus;
+	DBusGProxy *proxy;
+	GType track_type, list_type;
+	GTimer *timer;
+	unsigned count = 500, calls = 20, queued = 0;
+	unsigned start;
+	double elapsed;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'c':
+			calls = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!count || !calls)
+		usage(argv[0]);
+
+	g_type_init();
+
+	bus = dbus_g_bus_get(DBUS_BUS_SESSION, NULL);
+	if (!bus) {
+		fprintf(stderr, "no session bus\n");
+		return 1;
+	}
+	proxy = dbus_g_proxy_new_for_name(bus,
+			"org.scrobbler.service",
+			"/org/scrobbler/service",
+			"org.scrobbler.service");
+
+	track_type = dbus_g_type_get_struct("GValueArray",
+			G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+			G_TYPE_UINT, G_TYPE_INT, G_TYPE_INT,
+			G_TYPE_INVALID);
+	list_type = dbus_g_type_get_collection("GPtrArray", track_type);
+
+	/* all of them in the past */
+	start = time(NULL) - calls * count * 240;
+
+	timer = g_timer_new();
+	g_timer_stop(timer);
+
+	for (unsigned i = 0; i < calls; i++) {
+		GPtrArray *tracks;
+		GError *error = NULL;
+		guint n;
+
+		tracks = build_tracks(count, start + i * count * 240);
+
+		g_timer_continue(timer);
+		if (!dbus_g_proxy_call(proxy, "SubmitTracks", &error,
+					list_type, tracks, G_TYPE_INVALID,
+					G_TYPE_UINT, &n, G_TYPE_INVALID)) {
+			fprintf(stderr, "SubmitTracks failed: %s\n", error->message);
+			g_error_free(error);
+			free_tracks(tracks);
+			return 1;
+		}
+		g_timer_stop(timer);
+
+		queued += n;
+		free_tracks(tracks);
+	}
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	printf("calls: %u, tracks: %u, queued: %u\n", calls, calls * count, queued);
+	printf("%.3fms per call, %.1fus per track, %.0f tracks/s\n",
+			elapsed * 1000 / calls,
+			elapsed * 1000000 / (calls * count),
+			calls * count / elapsed);
+
+	g_timer_destroy(timer);
+	g_object_unref(proxy);
+	dbus_g_connection_unref(bus);
+
+	return 0;
+}
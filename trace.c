@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#include "trace.h"
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+/*
+ * A fixed ring of binary records. Writers only do an atomic increment and
+ * a store, so this can always be on; a record being overwritten while it's
+ * dumped is possible, but harmless.
+ */
+
+static struct sr_trace_record ring[SR_TRACE_SIZE];
+static volatile int head;
+
+static inline uint64_t
+clock_usec(clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+sr_trace(unsigned event,
+		unsigned session,
+		unsigned a,
+		unsigned b)
+{
+	struct sr_trace_record *r;
+	unsigned i;
+
+	i = g_atomic_int_exchange_and_add(&head, 1);
+	r = &ring[i & (SR_TRACE_SIZE - 1)];
+	r->time = clock_usec(CLOCK_MONOTONIC);
+	r->event = event;
+	r->session = session;
+	r->a = a;
+	r->b = b;
+}
+
+static inline int
+write_all(int fd,
+		const void *data,
+		size_t size)
+{
+	const char *p = data;
+
+	while (size) {
+		ssize_t r = write(fd, p, size);
+		if (r < 0)
+			return -1;
+		p += r;
+		size -= r;
+	}
+	return 0;
+}
+
+int
+sr_trace_dump(const char *file)
+{
+	struct sr_trace_header header;
+	unsigned h, first, count;
+	int fd, r;
+
+	h = g_atomic_int_get(&head);
+	count = h < SR_TRACE_SIZE ? h : SR_TRACE_SIZE;
+	first = (h - count) & (SR_TRACE_SIZE - 1);
+
+	header.magic = SR_TRACE_MAGIC;
+	header.version = SR_TRACE_VERSION;
+	header.count = count;
+	header.record_size = sizeof(struct sr_trace_record);
+	header.monotonic = clock_usec(CLOCK_MONOTONIC);
+	header.realtime = clock_usec(CLOCK_REALTIME);
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+
+	/* oldest first */
+	r = write_all(fd, &header, sizeof(header));
+	if (!r && first + count > SR_TRACE_SIZE) {
+		r = write_all(fd, &ring[first], (SR_TRACE_SIZE - first) * sizeof(*ring));
+		if (!r)
+			r = write_all(fd, ring, (first + count - SR_TRACE_SIZE) * sizeof(*ring));
+	}
+	else if (!r)
+		r = write_all(fd, &ring[first], count * sizeof(*ring));
+
+	close(fd);
+	return r;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SR_TRACE_MAGIC 0x52545253 /* "SRTR" */
+#define SR_TRACE_VERSION 1
+#define SR_TRACE_SIZE 4096 /* must be a power of two */
+
+enum sr_trace_event {
+	SR_TRACE_NONE,
+	SR_TRACE_NEXT, /* helper */
+	SR_TRACE_SUBMIT, /* a: services, b: tracks when submitted in bulk */
+	SR_TRACE_STOP,
+	SR_TRACE_CHECK_LAST, /* a: playtime, b: queued */
+	SR_TRACE_HANDSHAKE, /* request */
+	SR_TRACE_HANDSHAKE_CB, /* a: http status, b: ok */
+	SR_TRACE_SUBMIT_REQ, /* a: tracks */
+	SR_TRACE_SCROBBLE_CB, /* a: http status, b: ok */
+	SR_TRACE_NOW_PLAYING, /* request */
+	SR_TRACE_LOVE, /* request */
+	SR_TRACE_LOVE_CB, /* a: http status, b: queued */
+	SR_TRACE_FLUSH, /* helper, a: tracks since the last one */
+	SR_TRACE_WINDOWS, /* helper, a: radio windows in the last hour, b: total */
+	SR_TRACE_STALL, /* a: request kind, b: msec */
+	SR_TRACE_LAST,
+};
+
+struct sr_trace_record {
+	uint64_t time; /* monotonic, in microseconds */
+	uint32_t event;
+	uint32_t session;
+	uint32_t a;
+	uint32_t b;
+};
+
+struct sr_trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t record_size;
+	/* both clocks at dump time, in microseconds */
+	uint64_t monotonic;
+	uint64_t realtime;
+};
+
+void sr_trace(unsigned event, unsigned session, unsigned a, unsigned b);
+
+/* async-signal-safe */
+int sr_trace_dump(const char *file);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE_H */
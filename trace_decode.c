@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2010 Felipe Contreras
+ *
+ * This code is licenced under the LGPLv2.1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+static const char *names[] = {
+	[SR_TRACE_NONE] = "none",
+	[SR_TRACE_NEXT] = "next",
+	[SR_TRACE_SUBMIT] = "submit",
+	[SR_TRACE_STOP] = "stop",
+	[SR_TRACE_CHECK_LAST] = "check-last",
+	[SR_TRACE_HANDSHAKE] = "handshake",
+	[SR_TRACE_HANDSHAKE_CB] = "handshake-cb",
+	[SR_TRACE_SUBMIT_REQ] = "submit-req",
+	[SR_TRACE_SCROBBLE_CB] = "scrobble-cb",
+	[SR_TRACE_NOW_PLAYING] = "now-playing",
+	[SR_TRACE_LOVE] = "love",
+	[SR_TRACE_LOVE_CB] = "love-cb",
+	[SR_TRACE_FLUSH] = "flush",
+	[SR_TRACE_WINDOWS] = "windows",
+	[SR_TRACE_STALL] = "stall",
+};
+
+int main(int argc, char *argv[])
+{
+	FILE *f;
+	struct sr_trace_header header;
+	struct sr_trace_record r;
+	uint64_t prev = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+			header.magic != SR_TRACE_MAGIC ||
+			header.version != SR_TRACE_VERSION ||
+			header.record_size != sizeof(r)) {
+		fprintf(stderr, "%s: not a trace dump\n", argv[1]);
+		fclose(f);
+		return 1;
+	}
+
+	while (fread(&r, sizeof(r), 1, f) == 1) {
+		uint64_t real;
+		time_t sec;
+		char date[32];
+		const char *name = "unknown";
+
+		/* map monotonic time to wall time using the dump's reference */
+		real = header.realtime - (header.monotonic - r.time);
+		sec = real / 1000000;
+		strftime(date, sizeof(date), "%F %T", localtime(&sec));
+
+		if (r.event < SR_TRACE_LAST)
+			name = names[r.event];
+
+		printf("%s.%06u +%8.3fms %u %-12s %u %u\n",
+				date, (unsigned) (real % 1000000),
+				prev ? (r.time - prev) / 1000.0 : 0.0,
+				r.session, name, r.a, r.b);
+		prev = r.time;
+	}
+
+	fclose(f);
+	return 0;
+}
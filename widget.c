@@ -1,31 +1,194 @@
 #include "widget.h"
+#include "marshal.h"
 
 #include <gdk/gdk.h>
 #include <math.h>
+#include <stdbool.h>
+
+#define SIZE 96
+
+/* taps closer than this are sent as one call */
+#define LOVE_DELAY 300
+
+struct sr_widget_priv {
+	/* background for each state, rendered on first use */
+	cairo_surface_t *background[2];
+
+	/*
+	 * What is shown changes right away, the daemon is told later; if it
+	 * fails, the shown state goes back to the confirmed one.
+	 */
+	bool loved;
+	bool confirmed;
+	bool sent;
+	DBusGProxyCall *love_call;
+	unsigned love_timer;
+	/* bumped on every track change */
+	unsigned track;
+	unsigned sent_track;
+	/* the state when the widget appears */
+	DBusGProxyCall *current_call;
+};
 
 static GType type_id;
-static int loved;
 static DBusGProxy *sr_service;
 
+/* set SCROBBLER_EXPOSE_TIME to measure redraws */
+static GTimer *expose_timer;
+static unsigned expose_count;
+static double expose_total, expose_max;
+static GTimer *tap_timer;
+static bool tap_pending;
+
+static void send_love(struct sr_widget *self);
+
+static void
+love_reply(DBusGProxy *proxy,
+		DBusGProxyCall *call,
+		void *user_data)
+{
+	struct sr_widget *self = user_data;
+	struct sr_widget_priv *priv = self->priv;
+	GError *error = NULL;
+	gboolean ok;
+
+	ok = dbus_g_proxy_end_call(proxy, call, &error, G_TYPE_INVALID);
+	priv->love_call = NULL;
+
+	if (!ok) {
+		g_warning("love failed: %s", error->message);
+		g_error_free(error);
+	}
+
+	/* it was for a previous track; the current one may have a tap waiting */
+	if (priv->sent_track != priv->track) {
+		if (!priv->love_timer)
+			send_love(self);
+		return;
+	}
+
+	if (!ok) {
+		if (priv->love_timer) {
+			g_source_remove(priv->love_timer);
+			priv->love_timer = 0;
+		}
+		priv->loved = priv->confirmed;
+		gtk_widget_queue_draw(GTK_WIDGET(self));
+		return;
+	}
+
+	priv->confirmed = priv->sent;
+
+	/* tapped while the call was in flight */
+	if (!priv->love_timer)
+		send_love(self);
+}
+
+static void
+send_love(struct sr_widget *self)
+{
+	struct sr_widget_priv *priv = self->priv;
+
+	/* the reply sends whatever is left */
+	if (priv->love_call)
+		return;
+
+	if (priv->loved == priv->confirmed)
+		return;
+
+	priv->sent = priv->loved;
+	priv->sent_track = priv->track;
+	priv->love_call = dbus_g_proxy_begin_call(sr_service, "Love",
+			love_reply, self, NULL,
+			G_TYPE_BOOLEAN, priv->sent, G_TYPE_INVALID);
+}
+
+static gboolean
+do_love(void *data)
+{
+	struct sr_widget *self = data;
+	self->priv->love_timer = 0;
+	send_love(self);
+	return FALSE;
+}
+
 gboolean
 love_cb(GtkWidget *widget,
 		GdkEventButton *event,
 		void *user_data)
 {
 	struct sr_widget *self = user_data;
-	loved = ~loved;
+	struct sr_widget_priv *priv = self->priv;
+
+	if (tap_timer) {
+		g_timer_start(tap_timer);
+		tap_pending = true;
+	}
+
+	priv->loved = !priv->loved;
 	gtk_widget_queue_draw(GTK_WIDGET(self));
-	dbus_g_proxy_call(sr_service, "Love", NULL,
-			G_TYPE_BOOLEAN, loved, G_TYPE_INVALID,
-			G_TYPE_INVALID);
+
+	if (priv->love_timer)
+		g_source_remove(priv->love_timer);
+	priv->love_timer = g_timeout_add(LOVE_DELAY, do_love, self);
 	return TRUE;
 }
 
 static void
-next_cb(DBusGProxy *proxy, void *user_data)
+now_playing_cb(DBusGProxy *proxy,
+		const char *artist,
+		const char *title,
+		const char *album,
+		guint length,
+		gboolean loved,
+		void *user_data)
+{
+	struct sr_widget *self = user_data;
+	struct sr_widget_priv *priv = self->priv;
+
+	if (priv->love_timer) {
+		g_source_remove(priv->love_timer);
+		priv->love_timer = 0;
+	}
+	priv->track++;
+	priv->loved = priv->confirmed = loved;
+	gtk_widget_queue_draw(GTK_WIDGET(self));
+}
+
+static void
+current_reply(DBusGProxy *proxy,
+		DBusGProxyCall *call,
+		void *user_data)
 {
-	loved = 0;
-	gtk_widget_queue_draw(GTK_WIDGET(user_data));
+	struct sr_widget *self = user_data;
+	struct sr_widget_priv *priv = self->priv;
+	GError *error = NULL;
+	char *artist, *title, *album;
+	guint length;
+	gboolean loved;
+
+	priv->current_call = NULL;
+	if (!dbus_g_proxy_end_call(proxy, call, &error,
+				G_TYPE_STRING, &artist,
+				G_TYPE_STRING, &title,
+				G_TYPE_STRING, &album,
+				G_TYPE_UINT, &length,
+				G_TYPE_BOOLEAN, &loved,
+				G_TYPE_INVALID)) {
+		/* the daemon might not be running yet */
+		g_error_free(error);
+		return;
+	}
+	g_free(artist);
+	g_free(title);
+	g_free(album);
+
+	/* a track change or a tap already said more */
+	if (priv->track || priv->love_timer || priv->love_call)
+		return;
+
+	priv->loved = priv->confirmed = loved;
+	gtk_widget_queue_draw(GTK_WIDGET(self));
 }
 
 static GtkWidget *
@@ -51,11 +214,18 @@ static void
 instance_init(GTypeInstance *instance,
 		void *g_class)
 {
-	GtkWidget *contents = build_ui(SR_WIDGET(instance));
-	gtk_window_set_default_size(GTK_WINDOW(instance), 96, 96);
+	struct sr_widget *self = SR_WIDGET(instance);
+	GtkWidget *contents;
+
+	self->priv = G_TYPE_INSTANCE_GET_PRIVATE(instance, SR_WIDGET_TYPE, struct sr_widget_priv);
+
+	contents = build_ui(self);
+	gtk_window_set_default_size(GTK_WINDOW(instance), SIZE, SIZE);
 	gtk_container_add(GTK_CONTAINER(instance), contents);
 
-	dbus_g_proxy_connect_signal(sr_service, "Next", G_CALLBACK(next_cb), instance, NULL);
+	dbus_g_proxy_connect_signal(sr_service, "NowPlaying", G_CALLBACK(now_playing_cb), instance, NULL);
+	self->priv->current_call = dbus_g_proxy_begin_call(sr_service, "GetCurrent",
+			current_reply, self, NULL, G_TYPE_INVALID);
 }
 
 static void *parent_class;
@@ -69,38 +239,28 @@ realize(GtkWidget *widget)
 	GTK_WIDGET_CLASS(parent_class)->realize(widget);
 }
 
-static gboolean
-expose_event(GtkWidget *widget,
-		GdkEventExpose *event)
+static cairo_surface_t *
+render_background(GtkWidget *widget,
+		int state)
 {
+	cairo_surface_t *surface;
 	cairo_t *cr;
 	GdkColor color;
-
-	cr = gdk_cairo_create(GDK_DRAWABLE(widget->window));
-	gdk_cairo_region(cr, event->region);
-	cairo_clip(cr);
-
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-	cairo_set_source_rgba(cr, 0.0, 0.0, 0.0, 0.0);
-	cairo_paint(cr);
-
-	if (!loved) {
-		gtk_style_lookup_color(gtk_rc_get_style(widget), "DefaultBackgroundColor", &color);
-		cairo_set_source_rgba(cr, color.red / 65535.0, color.green / 65335.0, color.blue / 65535.0, 0.75);
-	}
-	else {
-		gtk_style_lookup_color(gtk_rc_get_style(widget), "SelectionColor", &color);
-		cairo_set_source_rgba(cr, color.red / 65535.0, color.green / 65335.0, color.blue / 65535.0, 0.75);
-	}
-
-	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
 	double x = 0.0,
 	       y = 0.0,
-	       width = 96,
-	       height = 96;
+	       width = SIZE,
+	       height = SIZE;
 	double radius = 4.0;
 	double degrees = M_PI / 180.0;
 
+	gtk_style_lookup_color(gtk_rc_get_style(widget),
+			state ? "SelectionColor" : "DefaultBackgroundColor", &color);
+
+	surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, SIZE, SIZE);
+	cr = cairo_create(surface);
+
+	cairo_set_source_rgba(cr, color.red / 65535.0, color.green / 65535.0, color.blue / 65535.0, 0.75);
+
 	cairo_new_sub_path(cr);
 	cairo_arc(cr, x + width - radius, y + radius, radius, -90 * degrees, 0 * degrees);
 	cairo_arc(cr, x + width - radius, y + height - radius, radius, 0 * degrees, 90 * degrees);
@@ -108,11 +268,100 @@ expose_event(GtkWidget *widget,
 	cairo_arc(cr, x + radius, y + radius, radius, 180 * degrees, 270 * degrees);
 	cairo_close_path(cr);
 
-	cairo_fill_preserve(cr);
+	cairo_fill(cr);
+
+	cairo_destroy(cr);
+
+	return surface;
+}
+
+static void
+drop_backgrounds(struct sr_widget_priv *priv)
+{
+	for (unsigned i = 0; i < G_N_ELEMENTS(priv->background); i++) {
+		if (!priv->background[i])
+			continue;
+		cairo_surface_destroy(priv->background[i]);
+		priv->background[i] = NULL;
+	}
+}
+
+static void
+report_expose(double elapsed)
+{
+	expose_count++;
+	expose_total += elapsed;
+	if (elapsed > expose_max)
+		expose_max = elapsed;
+	g_message("expose %u: %.3fms (avg %.3fms, max %.3fms)",
+			expose_count, elapsed * 1000,
+			expose_total * 1000 / expose_count, expose_max * 1000);
+}
+
+static gboolean
+expose_event(GtkWidget *widget,
+		GdkEventExpose *event)
+{
+	struct sr_widget_priv *priv = SR_WIDGET(widget)->priv;
+	cairo_t *cr;
+	int state = priv->loved;
+	gboolean r;
+
+	if (expose_timer)
+		g_timer_start(expose_timer);
+
+	if (!priv->background[state])
+		priv->background[state] = render_background(widget, state);
+
+	cr = gdk_cairo_create(GDK_DRAWABLE(widget->window));
+	gdk_cairo_region(cr, event->region);
+	cairo_clip(cr);
+
+	/* transparent outside of the rounded rectangle */
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_surface(cr, priv->background[state], 0, 0);
+	cairo_paint(cr);
 
 	cairo_destroy(cr);
 
-	return GTK_WIDGET_CLASS(parent_class)->expose_event(widget, event);
+	r = GTK_WIDGET_CLASS(parent_class)->expose_event(widget, event);
+
+	if (expose_timer)
+		report_expose(g_timer_elapsed(expose_timer, NULL));
+
+	if (tap_pending) {
+		tap_pending = false;
+		g_message("tap to repaint: %.3fms",
+				g_timer_elapsed(tap_timer, NULL) * 1000);
+	}
+
+	return r;
+}
+
+/* the theme changed */
+static void
+style_set(GtkWidget *widget,
+		GtkStyle *previous_style)
+{
+	drop_backgrounds(SR_WIDGET(widget)->priv);
+	if (GTK_WIDGET_CLASS(parent_class)->style_set)
+		GTK_WIDGET_CLASS(parent_class)->style_set(widget, previous_style);
+}
+
+static void
+finalize(GObject *object)
+{
+	struct sr_widget_priv *priv = SR_WIDGET(object)->priv;
+
+	if (priv->love_timer)
+		g_source_remove(priv->love_timer);
+	if (priv->love_call)
+		dbus_g_proxy_cancel_call(sr_service, priv->love_call);
+	if (priv->current_call)
+		dbus_g_proxy_cancel_call(sr_service, priv->current_call);
+	dbus_g_proxy_disconnect_signal(sr_service, "NowPlaying", G_CALLBACK(now_playing_cb), object);
+	drop_backgrounds(priv);
+	G_OBJECT_CLASS(parent_class)->finalize(object);
 }
 
 static void
@@ -125,15 +374,32 @@ class_init(void *g_class,
 	parent_class = g_type_class_peek_parent(g_class);
 	widget_class = GTK_WIDGET_CLASS(g_class);
 
+	G_OBJECT_CLASS(g_class)->finalize = finalize;
 	widget_class->realize = realize;
 	widget_class->expose_event = expose_event;
+	widget_class->style_set = style_set;
+
+	g_type_class_add_private(g_class, sizeof(struct sr_widget_priv));
+
+	if (g_getenv("SCROBBLER_EXPOSE_TIME")) {
+		expose_timer = g_timer_new();
+		tap_timer = g_timer_new();
+	}
 
 	bus = dbus_g_bus_get(DBUS_BUS_SESSION, NULL);
 	sr_service = dbus_g_proxy_new_for_name(bus,
 			"org.scrobbler.service",
 			"/org/scrobbler/service",
 			"org.scrobbler.service");
-	dbus_g_proxy_add_signal(sr_service, "Next", G_TYPE_INVALID, G_TYPE_INVALID);
+	dbus_g_object_register_marshaller(sr_marshal_VOID__STRING_STRING_STRING_UINT_BOOLEAN,
+			G_TYPE_NONE,
+			G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+			G_TYPE_UINT, G_TYPE_BOOLEAN,
+			G_TYPE_INVALID);
+	dbus_g_proxy_add_signal(sr_service, "NowPlaying",
+			G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
+			G_TYPE_UINT, G_TYPE_BOOLEAN,
+			G_TYPE_INVALID);
 	dbus_g_connection_unref(bus);
 }
 
@@ -142,6 +408,12 @@ class_finalize(void *g_class,
 		void *class_data)
 {
 	g_object_unref(sr_service);
+	if (expose_timer) {
+		g_timer_destroy(expose_timer);
+		expose_timer = NULL;
+		g_timer_destroy(tap_timer);
+		tap_timer = NULL;
+	}
 }
 
 GType